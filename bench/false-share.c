@@ -0,0 +1,258 @@
+/**
+ * @file false-share.c
+ * @brief Hoard-style false-sharing benchmarks (cache-thrash/cache-scratch).
+ *
+ * Each thread repeatedly allocates a small object, writes every byte of
+ * it a number of times, and frees it. If the allocator hands objects on
+ * the same cache line to different threads, the writes ping-pong that
+ * line between cores and throughput stops scaling.
+ *
+ *   active-false   threads allocate independently. Sharing comes from
+ *                  the allocator packing concurrent requests together.
+ *   passive-false  the main thread allocates one object per thread and
+ *                  hands them out. Each thread writes its object for the
+ *                  whole run, so sharing comes from how one thread's
+ *                  allocations were packed.
+ *   cache-scratch  as passive-false, but each thread frees its object
+ *                  first, then runs the active-false loop. An allocator
+ *                  that reuses the freed block keeps the line shared.
+ *
+ * Like bench-driver, only the standard malloc API is used, so run the
+ * same binary with and without LD_PRELOAD=<variant>/malloc.so.
+ *
+ * Output is a single CSV row:
+ *   mode,threads,size,iterations,writes,seconds,ops_per_sec,llc_misses,
+ *   shared_lines
+ *
+ * llc_misses is -1 if perf events are not available. shared_lines counts
+ * sampled cache lines that held objects of more than one thread; run
+ * under `perf c2c record` for HITM counts.
+*/
+
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE (64)
+#define LINE_SAMPLES (64) /* object lines recorded per thread */
+#define MAX_THREADS (1024)
+
+enum fs_mode {FS_ACTIVE, FS_PASSIVE, FS_SCRATCH};
+
+static const char *mode_names[] = {"active-false", "passive-false",
+                                   "cache-scratch"};
+
+typedef struct {
+  char *handoff;              /* object from the main thread, or NULL */
+  int cpu;                    /* -1 if not pinned */
+  struct timespec start, end;
+  uintptr_t lines[LINE_SAMPLES];
+  size_t nlines;
+} __attribute__((aligned(CACHE_LINE))) worker_arg;
+
+static enum fs_mode mode = FS_ACTIVE;
+static size_t obj_size = 8;
+static size_t iterations = 100000;
+static size_t writes = 100;
+static pthread_barrier_t start_barrier;
+
+/* Bookkeeping stays out of the allocator under test. */
+static worker_arg args[MAX_THREADS];
+static pthread_t tids[MAX_THREADS];
+
+static void note_line(worker_arg *arg, const void *p) {
+  if (arg->nlines < LINE_SAMPLES)
+    arg->lines[arg->nlines++] = (uintptr_t)p / CACHE_LINE;
+}
+
+/* volatile so the compiler keeps every store */
+static void scribble(volatile char *p) {
+  for (size_t w = 0; w < writes; w++)
+    for (size_t b = 0; b < obj_size; b++)
+      p[b]++;
+}
+
+static void *worker(void *argvp) {
+  worker_arg *arg = argvp;
+
+  if (arg->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(arg->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  pthread_barrier_wait(&start_barrier);
+  clock_gettime(CLOCK_MONOTONIC, &arg->start);
+  if (mode == FS_PASSIVE) {
+    note_line(arg, arg->handoff);
+    for (size_t i = 0; i < iterations; i++)
+      scribble(arg->handoff);
+  } else {
+    if (mode == FS_SCRATCH) free(arg->handoff);
+    for (size_t i = 0; i < iterations; i++) {
+      char *p = malloc(obj_size);
+      if (p == NULL) {
+        fprintf(stderr, "false-share: malloc failed\n");
+        exit(1);
+      }
+      note_line(arg, p);
+      scribble(p);
+      free(p);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &arg->end);
+  return NULL;
+}
+
+/* Last-level cache read misses of this process and threads created after. */
+static int open_llc_counter(void) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HW_CACHE;
+  pe.size = sizeof(pe);
+  pe.config = PERF_COUNT_HW_CACHE_LL |
+              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  pe.disabled = 1;
+  pe.inherit = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static int cmp_line(const void *a, const void *b) {
+  uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Number of distinct sampled lines that appear in two or more threads. */
+static size_t count_shared_lines(int nthreads) {
+  static uintptr_t all[MAX_THREADS * LINE_SAMPLES][2];
+  size_t n = 0, shared = 0;
+  for (int t = 0; t < nthreads; t++)
+    for (size_t i = 0; i < args[t].nlines; i++) {
+      all[n][0] = args[t].lines[i];
+      all[n][1] = t;
+      n++;
+    }
+  qsort(all, n, sizeof(all[0]), cmp_line);
+  for (size_t i = 0; i < n;) {
+    size_t j = i + 1;
+    bool multi = false;
+    for (; j < n && all[j][0] == all[i][0]; j++)
+      if (all[j][1] != all[i][1]) multi = true;
+    shared += multi;
+    i = j;
+  }
+  return shared;
+}
+
+static double ts_sec(const struct timespec *ts) {
+  return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-m mode] [-t threads] [-s size] [-i iterations] "
+          "[-w writes] [-p]\n"
+          "  -m M  active-false (default), passive-false or cache-scratch\n"
+          "  -t N  worker threads (default 1, at most %d)\n"
+          "  -s N  object size in bytes (default 8)\n"
+          "  -i N  objects per thread (default 100000)\n"
+          "  -w N  times each byte is written (default 100)\n"
+          "  -p    pin thread i to the i-th allowed CPU\n",
+          prog, MAX_THREADS);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int nthreads = 1, opt, perf_fd;
+  bool pin = false;
+  long long llc_misses = -1;
+
+  while ((opt = getopt(argc, argv, "m:t:s:i:w:p")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (!strcmp(optarg, "active-false")) mode = FS_ACTIVE;
+        else if (!strcmp(optarg, "passive-false")) mode = FS_PASSIVE;
+        else if (!strcmp(optarg, "cache-scratch")) mode = FS_SCRATCH;
+        else usage(argv[0]);
+        break;
+      case 't': nthreads = atoi(optarg); break;
+      case 's': obj_size = strtoul(optarg, NULL, 0); break;
+      case 'i': iterations = strtoul(optarg, NULL, 0); break;
+      case 'w': writes = strtoul(optarg, NULL, 0); break;
+      case 'p': pin = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || nthreads < 1 || nthreads > MAX_THREADS ||
+      obj_size == 0)
+    usage(argv[0]);
+
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE], ncpus = 0;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  for (int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+
+  /* back-to-back requests from one thread, as a producer would make */
+  for (int t = 0; t < nthreads; t++) {
+    args[t].cpu = pin ? cpus[t % ncpus] : -1;
+    if (mode != FS_ACTIVE && (args[t].handoff = malloc(obj_size)) == NULL) {
+      fprintf(stderr, "false-share: malloc failed\n");
+      exit(1);
+    }
+  }
+
+  if (pthread_barrier_init(&start_barrier, NULL, nthreads + 1) != 0) {
+    fprintf(stderr, "false-share: cannot create barrier\n");
+    exit(1);
+  }
+  perf_fd = open_llc_counter();
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    if (pthread_create(&tids[t], NULL, worker, &args[t]) != 0) {
+      fprintf(stderr, "false-share: cannot create thread %d\n", t);
+      exit(1);
+    }
+  }
+  pthread_barrier_wait(&start_barrier);
+  for (int t = 0; t < nthreads; t++)
+    pthread_join(tids[t], NULL);
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd, &llc_misses, sizeof(llc_misses)) != sizeof(llc_misses))
+      llc_misses = -1;
+    close(perf_fd);
+  }
+
+  /* Workers time themselves, as in bench-driver. */
+  double first = ts_sec(&args[0].start), last = ts_sec(&args[0].end);
+  for (int t = 1; t < nthreads; t++) {
+    if (ts_sec(&args[t].start) < first) first = ts_sec(&args[t].start);
+    if (ts_sec(&args[t].end) > last) last = ts_sec(&args[t].end);
+  }
+  double secs = last - first;
+  size_t total = (size_t)nthreads * iterations;
+  printf("%s,%d,%lu,%lu,%lu,%.6f,%.0f,%lld,%lu\n", mode_names[mode],
+         nthreads, obj_size, iterations, writes, secs, total / secs,
+         llc_misses, count_shared_lines(nthreads));
+
+  if (mode == FS_PASSIVE)
+    for (int t = 0; t < nthreads; t++) free(args[t].handoff);
+  return 0;
+}
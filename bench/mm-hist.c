@@ -0,0 +1,116 @@
+/**
+ * @file mm-hist.c
+ * @brief Percentile queries and reporting for latency histograms.
+*/
+
+#define _GNU_SOURCE
+#include "mm-hist.h"
+#include <stdio.h>
+#include <time.h>
+
+static const char *mm_op_names[MM_OP_COUNT] = {
+  "malloc", "free", "realloc", "calloc"
+};
+
+/* Largest value that maps to bucket idx. */
+static uint64_t bucket_high(unsigned idx) {
+  unsigned group, sub;
+  if (idx < MM_HIST_SUB_BUCKETS) return idx;
+  group = idx / MM_HIST_SUB_BUCKETS;
+  sub = idx % MM_HIST_SUB_BUCKETS;
+  uint64_t low = (uint64_t)(MM_HIST_SUB_BUCKETS + sub) << (group - 1);
+  return low + ((1UL << (group - 1)) - 1);
+}
+
+uint64_t mm_hist_percentile(const mm_hist *h, double p) {
+  uint64_t rank, seen = 0;
+  if (h->count == 0) return 0;
+  rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+  if (rank == 0) rank = 1;
+  for (unsigned i = 0; i < MM_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t high = bucket_high(i);
+      return high < h->max ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+void mm_hist_merge(mm_hist *dst, const mm_hist *src) {
+  if (src->count == 0) return;
+  for (unsigned i = 0; i < MM_HIST_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+  if (src->max > dst->max) dst->max = src->max;
+  dst->count += src->count;
+  dst->total += src->total;
+}
+
+void mm_latency_merge(mm_latency_stats *dst, const mm_latency_stats *src) {
+  for (int i = 0; i < MM_OP_COUNT; i++) {
+    mm_hist_merge(&dst->op[i], &src->op[i]);
+    dst->bytes[i] += src->bytes[i];
+  }
+  for (int i = 0; i < MM_HIST_SIZE_CLASSES; i++)
+    mm_hist_merge(&dst->size_class[i], &src->size_class[i]);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+double mm_tsc_per_ns(void) {
+  static double tsc_per_ns = 0;
+  if (tsc_per_ns == 0) {
+    /* spin for ~10ms against the monotonic clock */
+    uint64_t ns0 = now_ns(), tsc0 = mm_rdtsc(), ns1;
+    while ((ns1 = now_ns()) - ns0 < 10000000UL)
+      ;
+    tsc_per_ns = (double)(mm_rdtsc() - tsc0) / (ns1 - ns0);
+  }
+  return tsc_per_ns;
+}
+
+static void report_line(const char *label, const mm_hist *h, double scale) {
+  if (h->count == 0) return;
+  fprintf(stderr, "%-12s %10lu %9.1f %9.1f %9.1f %9.1f %11.1f\n", label,
+          h->count, (double)h->total / h->count / scale,
+          mm_hist_percentile(h, 50.0) / scale,
+          mm_hist_percentile(h, 99.0) / scale,
+          mm_hist_percentile(h, 99.9) / scale, h->max / scale);
+}
+
+void mm_latency_report(const mm_latency_stats *s) {
+  char label[32];
+  double scale = mm_tsc_per_ns();
+
+  fprintf(stderr, "%-12s %10s %9s %9s %9s %9s %11s   (ns)\n", "op", "count",
+          "mean", "p50", "p99", "p99.9", "max");
+  for (int i = 0; i < MM_OP_COUNT; i++)
+    report_line(mm_op_names[i], &s->op[i], scale);
+  for (int i = 0; i < MM_HIST_SIZE_CLASSES; i++) {
+    if (i == MM_HIST_SIZE_CLASSES - 1)
+      snprintf(label, sizeof(label), ">2^%d", i + 3);
+    else
+      snprintf(label, sizeof(label), "<=%lu", 1UL << (i + 4));
+    report_line(label, &s->size_class[i], scale);
+  }
+
+  /* ops/s counts only time spent inside the call */
+  fprintf(stderr, "%-12s %10s %12s %14s %10s\n", "op", "count", "ops/s",
+          "bytes", "MB/s");
+  for (int i = 0; i < MM_OP_COUNT; i++) {
+    const mm_hist *h = &s->op[i];
+    if (h->count == 0) continue;
+    double secs = h->total / scale / 1e9;
+    fprintf(stderr, "%-12s %10lu %12.0f", mm_op_names[i], h->count,
+            secs > 0 ? h->count / secs : 0);
+    if (i == MM_OP_REALLOC || i == MM_OP_CALLOC)
+      fprintf(stderr, " %14lu %10.1f", s->bytes[i],
+              secs > 0 ? s->bytes[i] / secs / 1e6 : 0);
+    fprintf(stderr, "\n");
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef _MM_HIST_H
+#define _MM_HIST_H
+
+/**
+ * @file mm-hist.h
+ * @brief Log-bucketed (HDR-style) latency histograms for the trace drivers.
+ *
+ * Values are TSC cycles. Each power of two is split into
+ * MM_HIST_SUB_BUCKETS linear sub-buckets, so a reported percentile is
+ * within 1/MM_HIST_SUB_BUCKETS of the true value. Histograms never
+ * allocate, so recording is safe inside a malloc replay loop.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MM_HIST_SUB_BITS (4)
+#define MM_HIST_SUB_BUCKETS (1 << MM_HIST_SUB_BITS)
+#define MM_HIST_BUCKETS ((64 - MM_HIST_SUB_BITS + 1) * MM_HIST_SUB_BUCKETS)
+
+/* Request sizes are grouped by power of two: <=16, <=32, ..., >2^30 */
+#define MM_HIST_SIZE_CLASSES (28)
+
+enum mm_hist_op {MM_OP_MALLOC, MM_OP_FREE, MM_OP_REALLOC, MM_OP_CALLOC,
+                 MM_OP_COUNT};
+
+typedef struct {
+  uint64_t count;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[MM_HIST_BUCKETS];
+} mm_hist;
+
+/* All histograms kept by one replay thread. */
+typedef struct {
+  mm_hist op[MM_OP_COUNT];
+  mm_hist size_class[MM_HIST_SIZE_CLASSES];
+  uint64_t bytes[MM_OP_COUNT];  /* preserved by realloc, zeroed by calloc */
+} mm_latency_stats;
+
+static inline uint64_t mm_rdtsc(void) {
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline unsigned mm_hist_index(uint64_t v) {
+  if (v < MM_HIST_SUB_BUCKETS) return (unsigned)v;
+  unsigned e = 63 - __builtin_clzll(v); /* e >= MM_HIST_SUB_BITS */
+  unsigned sub = (v >> (e - MM_HIST_SUB_BITS)) & (MM_HIST_SUB_BUCKETS - 1);
+  return (e - MM_HIST_SUB_BITS + 1) * MM_HIST_SUB_BUCKETS + sub;
+}
+
+static inline unsigned mm_hist_size_class(size_t size) {
+  unsigned sc;
+  if (size <= 16) return 0;
+  sc = (64 - __builtin_clzll(size - 1)) - 4; /* ceil(log2(size)) - 4 */
+  return sc < MM_HIST_SIZE_CLASSES ? sc : MM_HIST_SIZE_CLASSES - 1;
+}
+
+static inline void mm_hist_record(mm_hist *h, uint64_t v) {
+  h->buckets[mm_hist_index(v)]++;
+  if (h->count == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->count++;
+  h->total += v;
+}
+
+/* Record one op of `size` bytes that took `cycles`. */
+static inline void mm_latency_record(mm_latency_stats *s, enum mm_hist_op op,
+                                     size_t size, uint64_t cycles) {
+  mm_hist_record(&s->op[op], cycles);
+  mm_hist_record(&s->size_class[mm_hist_size_class(size)], cycles);
+}
+
+/* Count payload bytes an op had to move or clear. */
+static inline void mm_latency_record_bytes(mm_latency_stats *s,
+                                           enum mm_hist_op op, size_t bytes) {
+  s->bytes[op] += bytes;
+}
+
+/* Highest value in the bucket holding the p-th percentile (0 < p <= 100). */
+uint64_t mm_hist_percentile(const mm_hist *h, double p);
+
+void mm_hist_merge(mm_hist *dst, const mm_hist *src);
+
+void mm_latency_merge(mm_latency_stats *dst, const mm_latency_stats *src);
+
+/* Estimated TSC frequency in cycles per nanosecond. */
+double mm_tsc_per_ns(void);
+
+/* Print p50/p99/p99.9/max per op type and per size class, then per-op
+   throughput inside the allocator and bytes moved, to stderr. */
+void mm_latency_report(const mm_latency_stats *s);
+
+#endif // _MM_HIST_H
@@ -0,0 +1,60 @@
+#ifndef _MM_PAYLOAD_H
+#define _MM_PAYLOAD_H
+
+/**
+ * @file mm-payload.h
+ * @brief Payload patterns that let the drivers check realloc and calloc.
+ *
+ * After every allocation the driver fills the payload with a pattern
+ * derived from the block id and byte offset, so a realloc that copies
+ * too little, from the wrong place, or into an overlapping block shows
+ * up as a mismatch. All of this runs outside the timed region.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline uint64_t mm_payload_word(uint32_t id, size_t word) {
+  return ((uint64_t)id * 0x9e3779b97f4a7c15UL) ^ word;
+}
+
+static inline void mm_payload_fill(void *p, size_t size, uint32_t id) {
+  unsigned char *b = p;
+  size_t i;
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t w = mm_payload_word(id, i / 8);
+    memcpy(b + i, &w, 8);
+  }
+  if (i < size) {
+    uint64_t w = mm_payload_word(id, i / 8);
+    memcpy(b + i, &w, size - i);
+  }
+}
+
+/* @return offset of the first byte that differs, or size if none does */
+static inline size_t mm_payload_check(const void *p, size_t size,
+                                      uint32_t id) {
+  const unsigned char *b = p;
+  size_t i;
+  for (i = 0; i + 8 <= size; i += 8) {
+    uint64_t w = mm_payload_word(id, i / 8);
+    if (memcmp(b + i, &w, 8) != 0) break;
+  }
+  for (; i < size; i++) {
+    uint64_t w = mm_payload_word(id, i / 8);
+    if (b[i] != ((unsigned char *)&w)[i % 8]) return i;
+  }
+  return size;
+}
+
+/* @return offset of the first nonzero byte, or size if all are zero */
+static inline size_t mm_payload_check_zero(const void *p, size_t size) {
+  const unsigned char *b = p;
+  for (size_t i = 0; i < size; i++)
+    if (b[i] != 0) return i;
+  return size;
+}
+
+#endif // _MM_PAYLOAD_H
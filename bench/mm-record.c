@@ -0,0 +1,719 @@
+/**
+ * @file mm-record.c
+ * @brief LD_PRELOAD recorder that turns a program's allocations into a
+ * multi-threaded .rep trace.
+ *
+ *   LD_PRELOAD=./mm-record.so MM_RECORD_OUT=svc.rep ./service
+ *
+ * Every malloc, calloc, realloc, free and aligned allocation is logged
+ * as an event stamped with a global sequence number. A realloc is two
+ * events, numbered like a free and a malloc: the release of the old
+ * block before the call, the acquire of the new one after it. Each thread fills
+ * its own mmap'd chunk of events without locks; full chunks are pushed
+ * onto a lock-free list that a background thread drains to a raw spill
+ * file. At exit the events are put back in sequence order, pointers are
+ * mapped to block ids, and the trace is written in the
+ * "<tid> <op> <id> <size>" format read by bench/mm-trace.c, with the
+ * 4-line header of the CS:APP traces.
+ *
+ * Environment:
+ *   MM_RECORD_OUT         output path, %p expands to the pid
+ *                         (default mm-record.%p.rep)
+ *   MM_RECORD_TIMESTAMPS  if set, append ns since start to every line
+ *
+ * Nothing here calls the real malloc: buffers and tables are mmap'd and
+ * output goes through write(2). Calls made while the recorder itself is
+ * running (dlsym, pthread_create) are passed through unrecorded.
+ *
+ * Aligned allocations are recorded as plain allocations, since the
+ * trace format has no alignment field.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REC_CHUNK_EVENTS (1 << 14)
+#define REC_FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+#define REC_BOOTSTRAP_SIZE (64 * 1024)
+#define REC_PATH_MAX (4096)
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* op 0 marks an empty slot when events are put back in order */
+enum rec_op {REC_NONE, REC_ALLOC, REC_CALLOC, REC_REALLOC, REC_FREE,
+             REC_RELEASE};
+
+typedef struct {
+  uint64_t seq;
+  uint64_t ts;       /* ns since recording began, 0 if disabled */
+  uint64_t ptr;      /* returned block, or the block being released */
+  uint64_t old;      /* realloc: the block passed in */
+  uint64_t size;
+  uint32_t tid;
+  uint8_t op;
+  uint8_t unused[3];
+} rec_event; // 48 bytes
+
+typedef struct rec_chunk {
+  struct rec_chunk *next;   /* on the full list */
+  size_t count;
+  rec_event events[REC_CHUNK_EVENTS];
+} rec_chunk;
+
+typedef struct rec_thread {
+  struct rec_thread *next;  /* on the registry */
+  rec_chunk *chunk;
+  uint32_t tid;
+} rec_thread;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static void *(*real_valloc)(size_t);
+
+static volatile bool recording = false;
+static bool timestamps = false;
+static uint64_t rec_seq = 0;
+static struct timespec rec_start;
+
+static rec_chunk *full_list = NULL;     /* pushed by threads, drained by flusher */
+static rec_thread *registry = NULL;     /* every thread that recorded */
+static pthread_t flusher;
+static volatile bool flusher_stop = false;
+static int raw_fd = -1;
+static char out_path[REC_PATH_MAX];
+static char raw_path[REC_PATH_MAX + 8];
+
+static TLS bool rec_busy = false;       /* inside the recorder */
+static TLS rec_thread *rec_self = NULL;
+
+/* Serves dlsym's own allocations while the real functions are resolved. */
+static unsigned char bootstrap[REC_BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+static bool resolving = false;
+
+static bool in_bootstrap(void *p) {
+  return (unsigned char *)p >= bootstrap
+      && (unsigned char *)p < bootstrap + REC_BOOTSTRAP_SIZE;
+}
+
+static void *bootstrap_alloc(size_t size) {
+  size_t start = bootstrap_used;
+  size = (size + 15) & ~15UL;
+  if (start + size > REC_BOOTSTRAP_SIZE) return NULL;
+  bootstrap_used += size;
+  return bootstrap + start; /* static storage is already zeroed */
+}
+
+static void resolve(void) {
+  if (real_malloc != NULL || resolving) return;
+  resolving = true;
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+  real_memalign = dlsym(RTLD_NEXT, "memalign");
+  real_valloc = dlsym(RTLD_NEXT, "valloc");
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  resolving = false;
+}
+
+/************************************************************
+ * Recording
+ ************************************************************/
+
+static void *map_pages(size_t len) {
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static rec_thread *thread_init(void) {
+  rec_thread *t = map_pages(sizeof(rec_thread));
+  if (t == NULL) return NULL;
+  t->tid = (uint32_t)syscall(SYS_gettid);
+  t->chunk = map_pages(sizeof(rec_chunk));
+  if (t->chunk == NULL) return NULL;
+  t->next = __atomic_load_n(&registry, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&registry, &t->next, t, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return t;
+}
+
+/* Hand a full chunk to the flusher and start a new one. */
+static void chunk_retire(rec_thread *t) {
+  rec_chunk *c = t->chunk;
+  c->next = __atomic_load_n(&full_list, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&full_list, &c->next, c, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  t->chunk = map_pages(sizeof(rec_chunk));
+}
+
+/* Sequence numbers only need to respect happens-before between threads,
+   which a relaxed RMW on a single variable already does. */
+static inline uint64_t next_seq(void) {
+  return __atomic_fetch_add(&rec_seq, 1, __ATOMIC_RELAXED);
+}
+
+static void record(uint64_t seq, uint8_t op, void *ptr, void *old,
+                   size_t size) {
+  rec_thread *t = rec_self;
+  if (t == NULL && (t = rec_self = thread_init()) == NULL) return;
+  if (t->chunk == NULL) return; /* out of memory; drop the event */
+
+  rec_event *e = &t->chunk->events[t->chunk->count];
+  e->seq = seq;
+  e->ptr = (uint64_t)ptr;
+  e->old = (uint64_t)old;
+  e->size = size;
+  e->tid = t->tid;
+  e->op = op;
+  e->ts = 0;
+  if (timestamps) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    e->ts = (now.tv_sec - rec_start.tv_sec) * 1000000000UL
+          + now.tv_nsec - rec_start.tv_nsec;
+  }
+  if (++t->chunk->count == REC_CHUNK_EVENTS) chunk_retire(t);
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void drain_full_list(void) {
+  rec_chunk *c = __atomic_exchange_n(&full_list, NULL, __ATOMIC_ACQUIRE);
+  while (c != NULL) {
+    rec_chunk *next = c->next;
+    write_all(raw_fd, c->events, c->count * sizeof(rec_event));
+    munmap(c, sizeof(rec_chunk));
+    c = next;
+  }
+}
+
+static void *flusher_main(void *arg) {
+  (void)arg;
+  rec_busy = true; /* never record the flusher itself */
+  struct timespec delay = {0, REC_FLUSH_INTERVAL_NS};
+  while (!__atomic_load_n(&flusher_stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&delay, NULL);
+    drain_full_list();
+  }
+  return NULL;
+}
+
+/************************************************************
+ * Interposed API
+ ************************************************************/
+
+void *malloc(size_t size) {
+  void *p;
+  if (real_malloc == NULL) {
+    resolve();
+    if (real_malloc == NULL) return bootstrap_alloc(size);
+  }
+  if (!recording || rec_busy) return real_malloc(size);
+  rec_busy = true;
+  p = real_malloc(size);
+  if (p != NULL) record(next_seq(), REC_ALLOC, p, NULL, size);
+  rec_busy = false;
+  return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  void *p;
+  if (real_calloc == NULL) {
+    resolve();
+    if (real_calloc == NULL) return bootstrap_alloc(nmemb * size);
+  }
+  if (!recording || rec_busy) return real_calloc(nmemb, size);
+  rec_busy = true;
+  p = real_calloc(nmemb, size);
+  if (p != NULL) record(next_seq(), REC_CALLOC, p, NULL, nmemb * size);
+  rec_busy = false;
+  return p;
+}
+
+void free(void *ptr) {
+  if (ptr == NULL || in_bootstrap(ptr)) return;
+  if (real_free == NULL) resolve();
+  if (!recording || rec_busy) {
+    real_free(ptr);
+    return;
+  }
+  rec_busy = true;
+  /* take the sequence number first: once freed, another thread may be
+     handed the same address */
+  uint64_t seq = next_seq();
+  real_free(ptr);
+  record(seq, REC_FREE, ptr, NULL, 0);
+  rec_busy = false;
+}
+
+void *realloc(void *ptr, size_t size) {
+  void *p;
+  if (in_bootstrap(ptr)) {
+    /* bootstrap blocks are never freed; copy out what may be there */
+    size_t avail = bootstrap + REC_BOOTSTRAP_SIZE - (unsigned char *)ptr;
+    if ((p = malloc(size)) != NULL) memcpy(p, ptr, size < avail ? size : avail);
+    return p;
+  }
+  if (real_realloc == NULL) resolve();
+  if (!recording || rec_busy) return real_realloc(ptr, size);
+  rec_busy = true;
+  if (ptr == NULL) {
+    p = real_realloc(ptr, size);
+    if (p != NULL) record(next_seq(), REC_ALLOC, p, NULL, size);
+    rec_busy = false;
+    return p;
+  }
+  /* number the release of ptr first, like free(), and the acquire of
+     p after, like malloc(): another thread may be handed ptr once it is
+     released, or free p before the call returns */
+  uint64_t seq = next_seq();
+  p = real_realloc(ptr, size);
+  if (size == 0 && p == NULL) {
+    record(seq, REC_FREE, ptr, NULL, 0);
+  } else if (p != NULL) {
+    record(seq, REC_RELEASE, ptr, NULL, 0);
+    record(next_seq(), REC_REALLOC, p, ptr, size);
+  }
+  rec_busy = false;
+  return p;
+}
+
+static void *record_aligned(void *p, size_t size) {
+  if (recording && !rec_busy && p != NULL) {
+    rec_busy = true;
+    record(next_seq(), REC_ALLOC, p, NULL, size);
+    rec_busy = false;
+  }
+  return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (real_posix_memalign == NULL) resolve();
+  bool was_busy = rec_busy;
+  rec_busy = true; /* glibc may implement these on top of malloc */
+  int ret = real_posix_memalign(memptr, alignment, size);
+  rec_busy = was_busy;
+  if (ret == 0) record_aligned(*memptr, size);
+  return ret;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (real_aligned_alloc == NULL) resolve();
+  bool was_busy = rec_busy;
+  rec_busy = true;
+  void *p = real_aligned_alloc(alignment, size);
+  rec_busy = was_busy;
+  return record_aligned(p, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (real_memalign == NULL) resolve();
+  bool was_busy = rec_busy;
+  rec_busy = true;
+  void *p = real_memalign(alignment, size);
+  rec_busy = was_busy;
+  return record_aligned(p, size);
+}
+
+void *valloc(size_t size) {
+  if (real_valloc == NULL) resolve();
+  bool was_busy = rec_busy;
+  rec_busy = true;
+  void *p = real_valloc(size);
+  rec_busy = was_busy;
+  return record_aligned(p, size);
+}
+
+/************************************************************
+ * Conversion to .rep
+ ************************************************************/
+
+/* Open-addressing map from pointer (or tid) to id, with backward-shift
+   deletion so lookups never wade through tombstones. */
+typedef struct {
+  uint64_t *keys;     /* 0 = empty */
+  uint32_t *ids;
+  uint64_t *sizes;
+  uint64_t mask;
+} rec_map;
+
+static bool map_init(rec_map *m, uint64_t min_entries) {
+  uint64_t cap = 16;
+  while (cap < 2 * min_entries) cap <<= 1;
+  m->keys = map_pages(cap * sizeof(uint64_t));
+  m->ids = map_pages(cap * sizeof(uint32_t));
+  m->sizes = map_pages(cap * sizeof(uint64_t));
+  m->mask = cap - 1;
+  return m->keys && m->ids && m->sizes;
+}
+
+static void map_destroy(rec_map *m) {
+  munmap(m->keys, (m->mask + 1) * sizeof(uint64_t));
+  munmap(m->ids, (m->mask + 1) * sizeof(uint32_t));
+  munmap(m->sizes, (m->mask + 1) * sizeof(uint64_t));
+}
+
+static inline uint64_t map_slot(const rec_map *m, uint64_t key) {
+  return (key * 0x9e3779b97f4a7c15UL >> 17) & m->mask;
+}
+
+static int64_t map_find(const rec_map *m, uint64_t key) {
+  for (uint64_t i = map_slot(m, key);; i = (i + 1) & m->mask) {
+    if (m->keys[i] == key) return i;
+    if (m->keys[i] == 0) return -1;
+  }
+}
+
+static void map_put(rec_map *m, uint64_t key, uint32_t id, uint64_t size) {
+  uint64_t i = map_slot(m, key);
+  while (m->keys[i] != 0 && m->keys[i] != key) i = (i + 1) & m->mask;
+  m->keys[i] = key;
+  m->ids[i] = id;
+  m->sizes[i] = size;
+}
+
+static void map_erase(rec_map *m, uint64_t i) {
+  uint64_t j = i;
+  m->keys[i] = 0;
+  for (;;) {
+    j = (j + 1) & m->mask;
+    if (m->keys[j] == 0) return;
+    uint64_t home = map_slot(m, m->keys[j]);
+    /* move j back to i unless its home lies cyclically in (i, j] */
+    if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) continue;
+    m->keys[i] = m->keys[j];
+    m->ids[i] = m->ids[j];
+    m->sizes[i] = m->sizes[j];
+    m->keys[j] = 0;
+    i = j;
+  }
+}
+
+/* Buffered output through write(2). */
+typedef struct {
+  int fd;
+  size_t len;
+  char buf[1 << 16];
+} rec_out;
+
+static void out_flush(rec_out *o) {
+  write_all(o->fd, o->buf, o->len);
+  o->len = 0;
+}
+
+static void out_str(rec_out *o, const char *s) {
+  while (*s) {
+    if (o->len == sizeof(o->buf)) out_flush(o);
+    o->buf[o->len++] = *s++;
+  }
+}
+
+static void out_u64(rec_out *o, uint64_t v) {
+  char tmp[21];
+  int n = sizeof(tmp) - 1;
+  tmp[n] = '\0';
+  do {
+    tmp[--n] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0);
+  out_str(o, &tmp[n]);
+}
+
+typedef struct {
+  uint64_t num_ids;
+  uint64_t num_ops;
+  uint64_t max_alloc;
+  uint64_t lost_frees;  /* ids freed by free_lost() */
+} rec_summary;
+
+/* Map a recorded tid to its trace tid, numbering new ones in order. */
+static uint32_t trace_tid(rec_map *tids, uint32_t tid, uint32_t *next_tid) {
+  int64_t i = map_find(tids, tid);
+  if (i < 0) {
+    map_put(tids, tid, *next_tid, 0);
+    return (*next_tid)++;
+  }
+  return tids->ids[i];
+}
+
+/* Count one op and, unless out is NULL, write it. */
+static void emit_op(rec_out *out, rec_summary *s, uint32_t tid, char op,
+                    uint32_t id, uint64_t size, uint64_t ts) {
+  s->num_ops++;
+  if (out == NULL) return;
+  out_u64(out, tid);
+  out_str(out, op == 'a' ? " a " : op == 'c' ? " c " :
+               op == 'r' ? " r " : " f ");
+  out_u64(out, id);
+  if (op != 'f') {
+    out_str(out, " ");
+    out_u64(out, size);
+  }
+  if (timestamps) {
+    out_str(out, " ");
+    out_u64(out, ts);
+  }
+  out_str(out, "\n");
+}
+
+/*
+ * An id still live when its address is handed out again, or when its
+ * thread starts another realloc, lost the event that ended it: it was in
+ * flight at exit, or dropped when out of memory. Free it here, on the
+ * current thread, rather than leak it in the trace.
+ */
+static void free_lost(rec_map *m, int64_t i, rec_out *out, rec_summary *s,
+                      uint32_t tid, uint64_t ts, uint64_t *live) {
+  emit_op(out, s, tid, 'f', m->ids[i], 0, ts);
+  *live -= m->sizes[i];
+  map_erase(m, i);
+  s->lost_frees++;
+}
+
+/*
+ * Walk the events in sequence order. With out == NULL only the header
+ * fields are computed; otherwise every op is written. Frees of blocks
+ * allocated before recording started are dropped. The two halves of a
+ * realloc are joined through pending, keyed by thread: the release moves
+ * the old block's id out of ptrs, and the acquire hands it the new
+ * address as one 'r'.
+ */
+static void convert_pass(const rec_event *ev, uint64_t n, rec_map *ptrs,
+                         rec_map *tids, rec_map *pending, rec_summary *s,
+                         rec_out *out) {
+  uint64_t live = 0;
+  uint32_t next_id = 0, next_tid = 0;
+  int64_t i;
+
+  s->num_ops = 0;
+  s->max_alloc = 0;
+  s->lost_frees = 0;
+  for (uint64_t k = 0; k < n; k++) {
+    const rec_event *e = &ev[k];
+    uint32_t id, tid;
+    char op;
+
+    if (e->op == REC_NONE) continue;
+    switch (e->op) {
+      case REC_ALLOC:
+      case REC_CALLOC:
+        op = e->op == REC_ALLOC ? 'a' : 'c';
+        tid = trace_tid(tids, e->tid, &next_tid);
+        if ((i = map_find(ptrs, e->ptr)) >= 0)
+          free_lost(ptrs, i, out, s, tid, e->ts, &live);
+        id = next_id++;
+        map_put(ptrs, e->ptr, id, e->size);
+        live += e->size;
+        break;
+      case REC_RELEASE:
+        if ((i = map_find(pending, e->tid)) >= 0)
+          free_lost(pending, i, out, s, trace_tid(tids, e->tid, &next_tid),
+                    e->ts, &live);
+        if ((i = map_find(ptrs, e->ptr)) >= 0) {
+          /* still counted live until the acquire */
+          map_put(pending, e->tid, ptrs->ids[i], ptrs->sizes[i]);
+          map_erase(ptrs, i);
+        }
+        continue;
+      case REC_REALLOC:
+        tid = trace_tid(tids, e->tid, &next_tid);
+        if ((i = map_find(pending, e->tid)) < 0) {
+          op = 'a'; /* block predates recording */
+          id = next_id++;
+        } else {
+          op = 'r';
+          id = pending->ids[i];
+          live -= pending->sizes[i];
+          map_erase(pending, i);
+        }
+        if ((i = map_find(ptrs, e->ptr)) >= 0)
+          free_lost(ptrs, i, out, s, tid, e->ts, &live);
+        map_put(ptrs, e->ptr, id, e->size);
+        live += e->size;
+        break;
+      case REC_FREE:
+        if ((i = map_find(ptrs, e->ptr)) < 0) continue;
+        op = 'f';
+        tid = trace_tid(tids, e->tid, &next_tid);
+        id = ptrs->ids[i];
+        live -= ptrs->sizes[i];
+        map_erase(ptrs, i);
+        break;
+      default:
+        continue;
+    }
+    if (live > s->max_alloc) s->max_alloc = live;
+    emit_op(out, s, tid, op, id, e->size, e->ts);
+  }
+  s->num_ids = next_id;
+}
+
+static void clear_map(rec_map *m) {
+  memset(m->keys, 0, (m->mask + 1) * sizeof(uint64_t));
+}
+
+static void convert(void) {
+  struct stat st;
+  uint64_t n = __atomic_load_n(&rec_seq, __ATOMIC_ACQUIRE);
+  int fd;
+
+  if (fstat(raw_fd, &st) < 0 || st.st_size == 0) return;
+  const rec_event *raw = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                              raw_fd, 0);
+  if (raw == MAP_FAILED) return;
+  uint64_t nraw = st.st_size / sizeof(rec_event);
+
+  /* Sequence numbers are dense, so each event goes straight to its slot;
+     slots of events still in flight at exit stay empty. */
+  rec_event *ev = map_pages(n * sizeof(rec_event));
+  if (ev == NULL) goto out_raw;
+  for (uint64_t k = 0; k < nraw; k++)
+    if (raw[k].seq < n) ev[raw[k].seq] = raw[k];
+
+  rec_map ptrs, tids, pending;
+  rec_summary s;
+  if (!map_init(&ptrs, nraw) || !map_init(&tids, UINT16_MAX + 1)
+      || !map_init(&pending, UINT16_MAX + 1))
+    goto out_ev;
+  convert_pass(ev, n, &ptrs, &tids, &pending, &s, NULL);
+  clear_map(&ptrs);
+  clear_map(&tids);
+  clear_map(&pending);
+
+  if ((fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+    rec_out *out = map_pages(sizeof(rec_out));
+    if (out != NULL) {
+      out->fd = fd;
+      out_str(out, "1\n");  /* weight: utilization and throughput */
+      out_u64(out, s.num_ids);
+      out_str(out, "\n");
+      out_u64(out, s.num_ops);
+      out_str(out, "\n");
+      out_u64(out, s.max_alloc);
+      out_str(out, "\n");
+      convert_pass(ev, n, &ptrs, &tids, &pending, &s, out);
+      out_flush(out);
+      munmap(out, sizeof(rec_out));
+    }
+    close(fd);
+  }
+  if (s.lost_frees > 0) {
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "mm-record: %llu blocks lost "
+                       "their free; freed where next seen\n",
+                       (unsigned long long)s.lost_frees);
+    write_all(STDERR_FILENO, msg, len);
+  }
+  map_destroy(&ptrs);
+  map_destroy(&tids);
+  map_destroy(&pending);
+out_ev:
+  munmap(ev, n * sizeof(rec_event));
+out_raw:
+  munmap((void *)raw, st.st_size);
+}
+
+/************************************************************
+ * Start and finish
+ ************************************************************/
+
+/* A forked child has no flusher thread; it simply stops recording. */
+static void mm_record_atfork_child(void) {
+  recording = false;
+}
+
+__attribute__((constructor))
+static void mm_record_start(void) {
+  const char *out = getenv("MM_RECORD_OUT");
+
+  resolve();
+  rec_busy = true;
+  if (out == NULL) out = "mm-record.%p.rep";
+  /* expand %p to the pid, so exec'd children don't overwrite each other */
+  size_t len = 0;
+  for (const char *c = out; *c && len < sizeof(out_path) - 16; c++) {
+    if (c[0] == '%' && c[1] == 'p') {
+      len += snprintf(&out_path[len], 16, "%d", (int)getpid());
+      c++;
+    } else {
+      out_path[len++] = *c;
+    }
+  }
+  out_path[len] = '\0';
+  snprintf(raw_path, sizeof(raw_path), "%s.raw", out_path);
+  timestamps = getenv("MM_RECORD_TIMESTAMPS") != NULL;
+  clock_gettime(CLOCK_MONOTONIC, &rec_start);
+
+  raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (raw_fd < 0) {
+    rec_busy = false;
+    return;
+  }
+  if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+    close(raw_fd);
+    unlink(raw_path);
+    raw_fd = -1;
+    rec_busy = false;
+    return;
+  }
+  pthread_atfork(NULL, NULL, mm_record_atfork_child);
+  rec_busy = false;
+  recording = true;
+}
+
+__attribute__((destructor))
+static void mm_record_finish(void) {
+  if (!recording) return;
+  recording = false;
+  rec_busy = true;
+
+  __atomic_store_n(&flusher_stop, true, __ATOMIC_RELEASE);
+  pthread_join(flusher, NULL);
+  drain_full_list();
+
+  /* partially filled chunks, including those of exited threads */
+  for (rec_thread *t = __atomic_load_n(&registry, __ATOMIC_ACQUIRE);
+       t != NULL; t = t->next) {
+    if (t->chunk != NULL && t->chunk->count > 0)
+      write_all(raw_fd, t->chunk->events,
+                t->chunk->count * sizeof(rec_event));
+  }
+  convert();
+  close(raw_fd);
+  unlink(raw_path);
+}
@@ -0,0 +1,235 @@
+/**
+ * @file mm-trace.c
+ * @brief Loading, converting and writing binary traces.
+ *
+ * Nothing in this file calls malloc: the allocator under test should
+ * only ever see the replayed trace.
+*/
+
+#define _GNU_SOURCE
+#include "mm-trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MM_TRACE_MAX_TOKENS 5
+/* Most records a mapping can hold after the header without overflow */
+#define MM_TRACE_MAX_OPS \
+  ((SIZE_MAX - sizeof(mm_trace_header)) / sizeof(mm_trace_op))
+
+/* Split one line into whitespace-separated tokens; returns the count. */
+static int tokenize(const char *p, const char *end, const char **tok,
+                    size_t *tok_len) {
+  int n = 0;
+  while (p < end && n < MM_TRACE_MAX_TOKENS) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p == end) break;
+    tok[n] = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    tok_len[n] = p - tok[n];
+    n++;
+  }
+  return n;
+}
+
+static int parse_u64(const char *s, size_t len, uint64_t *out) {
+  uint64_t v = 0;
+  if (len == 0) return -1;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    uint64_t d = s[i] - '0';
+    if (v > (UINT64_MAX - d) / 10) return -1; /* would wrap */
+    v = v * 10 + d;
+  }
+  *out = v;
+  return 0;
+}
+
+/* Return the end of the line starting at p (excluding the newline). */
+static const char *line_end(const char *p, const char *end) {
+  const char *nl = memchr(p, '\n', end - p);
+  return nl ? nl : end;
+}
+
+static int parse_op(const char **tok, size_t *tok_len, int ntok,
+                    mm_trace_op *op) {
+  uint64_t tid = 0, id, size = 0;
+  int i = 0;
+
+  /* multi-threaded traces prefix every op with a tid */
+  if (ntok > 0 && tok[0][0] >= '0' && tok[0][0] <= '9') {
+    if (parse_u64(tok[0], tok_len[0], &tid) < 0 || tid > UINT16_MAX)
+      return -1;
+    i = 1;
+  }
+  if (ntok < i + 2 || tok_len[i] != 1) return -1;
+  switch (tok[i][0]) {
+    case 'a': op->op = MM_TRACE_ALLOC; break;
+    case 'f': op->op = MM_TRACE_FREE; break;
+    case 'r': op->op = MM_TRACE_REALLOC; break;
+    case 'c': op->op = MM_TRACE_CALLOC; break;
+    default: return -1;
+  }
+  if (parse_u64(tok[i + 1], tok_len[i + 1], &id) < 0 || id > UINT32_MAX)
+    return -1;
+  if (op->op != MM_TRACE_FREE) {
+    if (ntok < i + 3 || parse_u64(tok[i + 2], tok_len[i + 2], &size) < 0)
+      return -1;
+  }
+  op->unused = 0;
+  op->tid = (uint16_t)tid;
+  op->id = (uint32_t)id;
+  op->size = size;
+  return 0;
+}
+
+static int convert_text(const char *text, size_t len, mm_trace *trace) {
+  const char *p = text, *end = text + len, *eol;
+  const char *tok[MM_TRACE_MAX_TOKENS];
+  size_t tok_len[MM_TRACE_MAX_TOKENS];
+  uint64_t hdr[4];
+  int nhdr = 0, ntok;
+
+  /* Header lines hold a single integer each: either
+     <num_ids> <num_ops>, or <weight> <num_ids> <num_ops> <max_alloc>. */
+  while (p < end) {
+    eol = line_end(p, end);
+    ntok = tokenize(p, eol, tok, tok_len);
+    if (ntok > 1) break;
+    if (ntok == 1) {
+      if (nhdr == 4 || parse_u64(tok[0], tok_len[0], &hdr[nhdr]) < 0)
+        goto bad_trace;
+      nhdr++;
+    }
+    p = eol + 1;
+  }
+  if (nhdr != 2 && nhdr != 4) goto bad_trace;
+
+  mm_trace_header h = {.magic = MM_TRACE_MAGIC, .version = MM_TRACE_VERSION};
+  if (nhdr == 4) {
+    h.weight = hdr[0];
+    h.num_ids = hdr[1];
+    h.num_ops = hdr[2];
+    h.max_alloc = hdr[3];
+  } else {
+    h.weight = 1;
+    h.num_ids = hdr[0];
+    h.num_ops = hdr[1];
+  }
+
+  if (h.num_ops > MM_TRACE_MAX_OPS) goto bad_trace;
+  size_t map_len = sizeof(mm_trace_header) + h.num_ops * sizeof(mm_trace_op);
+  void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) return -1;
+  mm_trace_op *ops = (mm_trace_op *)((mm_trace_header *)map + 1);
+
+  uint64_t pos = 0;
+  while (p < end && pos < h.num_ops) {
+    eol = line_end(p, end);
+    ntok = tokenize(p, eol, tok, tok_len);
+    p = eol + 1;
+    if (ntok == 0) continue;
+    if (parse_op(tok, tok_len, ntok, &ops[pos]) < 0
+        || ops[pos].id >= h.num_ids) {
+      munmap(map, map_len);
+      goto bad_trace;
+    }
+    if (ops[pos].tid >= h.num_threads) h.num_threads = ops[pos].tid + 1;
+    pos++;
+  }
+  if (pos == 0) { /* the drivers need at least one thread */
+    munmap(map, map_len);
+    goto bad_trace;
+  }
+  h.num_ops = pos;
+  memcpy(map, &h, sizeof(h));
+
+  trace->map = map;
+  trace->map_len = map_len;
+  trace->header = map;
+  trace->ops = ops;
+  return 0;
+
+bad_trace:
+  errno = EINVAL;
+  return -1;
+}
+
+/* Check every record of a binary trace against its header, so the
+   drivers can index by id and tid without checking. */
+static int check_ops(const mm_trace_header *h, const mm_trace_op *ops) {
+  for (uint64_t i = 0; i < h->num_ops; i++) {
+    if (ops[i].op > MM_TRACE_CALLOC || ops[i].id >= h->num_ids
+        || ops[i].tid >= h->num_threads)
+      return -1;
+  }
+  return 0;
+}
+
+int mm_trace_open(const char *path, mm_trace *trace) {
+  struct stat st;
+  int fd, ret = -1;
+  void *file;
+
+  if ((fd = open(path, O_RDONLY)) < 0) return -1;
+  if (fstat(fd, &st) < 0) goto out;
+  if (st.st_size == 0) {
+    errno = EINVAL;
+    goto out;
+  }
+  /* populate up front so page faults stay out of the replay */
+  file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (file == MAP_FAILED) goto out;
+
+  if ((size_t)st.st_size >= sizeof(mm_trace_header)
+      && ((mm_trace_header *)file)->magic == MM_TRACE_MAGIC) {
+    const mm_trace_header *h = file;
+    if (h->version != MM_TRACE_VERSION || h->num_ops == 0
+        || h->num_ops > MM_TRACE_MAX_OPS
+        || (size_t)st.st_size < sizeof(*h) + h->num_ops * sizeof(mm_trace_op)
+        || check_ops(h, (const mm_trace_op *)(h + 1)) < 0) {
+      munmap(file, st.st_size);
+      errno = EINVAL;
+      goto out;
+    }
+    trace->map = file;
+    trace->map_len = st.st_size;
+    trace->header = h;
+    trace->ops = (const mm_trace_op *)(h + 1);
+    ret = 0;
+  } else {
+    ret = convert_text(file, st.st_size, trace);
+    munmap(file, st.st_size);
+  }
+
+out:
+  close(fd);
+  return ret;
+}
+
+void mm_trace_close(mm_trace *trace) {
+  munmap(trace->map, trace->map_len);
+  trace->map = NULL;
+  trace->header = NULL;
+  trace->ops = NULL;
+}
+
+int mm_trace_write(const mm_trace *trace, int fd) {
+  const char *buf = (const char *)trace->header;
+  size_t left = sizeof(mm_trace_header)
+              + trace->header->num_ops * sizeof(mm_trace_op);
+  while (left > 0) {
+    ssize_t n = write(fd, buf, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    left -= n;
+  }
+  return 0;
+}
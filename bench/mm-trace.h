@@ -0,0 +1,74 @@
+#ifndef _MM_TRACE_H
+#define _MM_TRACE_H
+
+/**
+ * @file mm-trace.h
+ * @brief Compact binary trace format shared by the drivers.
+ *
+ * A binary trace is an mm_trace_header followed by num_ops fixed-width
+ * mm_trace_op records, in native byte order. Drivers mmap the file and
+ * replay straight out of the mapping; loading only makes one pass to
+ * check every id and tid against the header.
+ *
+ * Text .rep traces (both the 4-line-header CS:APP format and the
+ * "<tid> <op> <id> <size>" multi-threaded format) are still accepted;
+ * they are converted into an anonymous mapping of the same layout.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MM_TRACE_MAGIC (0x314352544d4d4dUL) /* "MMMTRC1" */
+#define MM_TRACE_VERSION (1)
+
+/* Same order as the drivers' op types and mm_hist_op */
+enum mm_trace_opcode {
+  MM_TRACE_ALLOC,
+  MM_TRACE_FREE,
+  MM_TRACE_REALLOC,
+  MM_TRACE_CALLOC
+};
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t weight;        /* scoring weight from the .rep header */
+  uint64_t num_ids;       /* number of distinct block ids */
+  uint64_t num_ops;       /* number of records that follow */
+  uint64_t max_alloc;     /* peak live payload bytes, 0 if unknown */
+  uint32_t num_threads;   /* highest tid + 1 */
+  uint32_t unused;
+} mm_trace_header; // 48 bytes
+
+typedef struct {
+  uint8_t  op;            /* enum mm_trace_opcode */
+  uint8_t  unused;
+  uint16_t tid;
+  uint32_t id;
+  uint64_t size;
+} mm_trace_op; // 16 bytes
+
+typedef struct {
+  const mm_trace_header *header;
+  const mm_trace_op *ops;
+  void *map;
+  size_t map_len;
+} mm_trace;
+
+/**
+ * @brief Map a binary trace, or convert a text trace, without calling malloc.
+ * A trace with no ops fails with EINVAL, so a loaded one always has at
+ * least one thread.
+ * @return 0 on success, -1 on failure (errno is set).
+ */
+int mm_trace_open(const char *path, mm_trace *trace);
+
+void mm_trace_close(mm_trace *trace);
+
+/**
+ * @brief Write a loaded trace to fd in binary format.
+ * @return 0 on success, -1 on failure.
+ */
+int mm_trace_write(const mm_trace *trace, int fd);
+
+#endif // _MM_TRACE_H
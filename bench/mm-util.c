@@ -0,0 +1,76 @@
+/**
+ * @file mm-util.c
+ * @brief Reporting for space utilization and fragmentation.
+*/
+
+#define _GNU_SOURCE
+#include "mm-util.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static const char *mm_weight_names[] = {
+  "ignored in scoring", "utilization and throughput", "utilization only",
+  "throughput only"
+};
+
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+  return ru.ru_maxrss;
+}
+
+long mm_rss_begin(void) {
+  char buf[64];
+  long pages = 0;
+  ssize_t n;
+  int fd;
+
+  /* "5" resets the peak RSS (VmHWM) that getrusage reports */
+  if ((fd = open("/proc/self/clear_refs", O_WRONLY)) >= 0) {
+    n = write(fd, "5", 1);
+    close(fd);
+    if (n != 1) return peak_rss_kb();
+  } else {
+    return peak_rss_kb();
+  }
+  /* /proc/self/statm: <size> <resident> ... in pages */
+  if ((fd = open("/proc/self/statm", O_RDONLY)) < 0) return peak_rss_kb();
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return peak_rss_kb();
+  buf[n] = '\0';
+  if (sscanf(buf, "%*s %ld", &pages) != 1) return peak_rss_kb();
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double pct(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+void mm_util_report(const mm_util_stats *u, const mm_trace_header *h,
+                    long rss_kb_before) {
+  uint64_t rss = (uint64_t)(peak_rss_kb() - rss_kb_before) * 1024;
+
+  fprintf(stderr, "weight %u: %s\n", h->weight,
+          h->weight <= MM_WEIGHT_THROUGHPUT ? mm_weight_names[h->weight]
+                                            : "unknown");
+  if (!mm_weight_scores_util(h->weight)) return;
+
+  fprintf(stderr, "peak payload  %12lu bytes", u->peak_live);
+  if (h->max_alloc != 0 && h->max_alloc != u->peak_live)
+    fprintf(stderr, " (trace header says %lu)", h->max_alloc);
+  fprintf(stderr, "\npeak arena    %12lu bytes   utilization   %5.1f%%\n",
+          u->peak_arena, pct(u->peak_live, u->peak_arena));
+  if (u->peak_arena >= u->block_at_peak) {
+    fprintf(stderr, "internal frag %12lu bytes   %5.1f%% of arena\n",
+            u->block_at_peak - u->peak_live,
+            pct(u->block_at_peak - u->peak_live, u->peak_arena));
+    fprintf(stderr, "external frag %12lu bytes   %5.1f%% of arena\n",
+            u->peak_arena - u->block_at_peak,
+            pct(u->peak_arena - u->block_at_peak, u->peak_arena));
+  }
+  fprintf(stderr, "RSS growth    %12lu bytes   payload/RSS   %5.1f%%\n",
+          rss, pct(u->peak_live, rss));
+}
@@ -0,0 +1,80 @@
+#ifndef _MM_UTIL_H
+#define _MM_UTIL_H
+
+/**
+ * @file mm-util.h
+ * @brief Space utilization and fragmentation accounting for the drivers.
+ *
+ * The driver reports every allocation and free with its payload size and
+ * the size of the block the allocator actually used, and samples the
+ * arena size after each allocation. At the end of a replay this gives:
+ *
+ *   utilization     peak live payload / peak arena
+ *   internal frag   (block bytes - payload bytes) at the payload peak,
+ *                   as a fraction of peak arena
+ *   external frag   arena bytes not in live blocks at the payload peak,
+ *                   as a fraction of peak arena
+ *
+ * Peak RSS growth over the replay is reported next to the arena numbers,
+ * since it also covers metadata that lives outside the arena. Loading a
+ * text trace briefly maps the whole file, so the kernel's peak RSS is
+ * reset before the replay starts (clear_refs, Linux 4.0+).
+*/
+
+#include "mm-trace.h"
+#include <stdbool.h>
+
+typedef struct {
+  uint64_t live;            /* payload bytes currently allocated */
+  uint64_t live_block;      /* block bytes backing them */
+  uint64_t peak_live;
+  uint64_t block_at_peak;   /* live_block when peak_live was reached */
+  uint64_t peak_arena;
+} mm_util_stats;
+
+/* Trace weights, from traces/README */
+#define MM_WEIGHT_IGNORE (0)
+#define MM_WEIGHT_BOTH (1)
+#define MM_WEIGHT_UTIL (2)
+#define MM_WEIGHT_THROUGHPUT (3)
+
+static inline bool mm_weight_scores_util(uint32_t weight) {
+  return weight == MM_WEIGHT_BOTH || weight == MM_WEIGHT_UTIL;
+}
+
+static inline bool mm_weight_scores_throughput(uint32_t weight) {
+  return weight == MM_WEIGHT_BOTH || weight == MM_WEIGHT_THROUGHPUT;
+}
+
+static inline void mm_util_alloc(mm_util_stats *u, size_t payload,
+                                 size_t block, size_t arena) {
+  u->live += payload;
+  u->live_block += block;
+  if (u->live > u->peak_live) {
+    u->peak_live = u->live;
+    u->block_at_peak = u->live_block;
+  }
+  if (arena > u->peak_arena) u->peak_arena = arena;
+}
+
+static inline void mm_util_free(mm_util_stats *u, size_t payload,
+                                size_t block) {
+  u->live -= payload;
+  u->live_block -= block;
+}
+
+/**
+ * @brief Reset the process's peak RSS, so it only covers what follows.
+ * @return Current RSS in kB, to pass to mm_util_report.
+ */
+long mm_rss_begin(void);
+
+/**
+ * @brief Print utilization and fragmentation to stderr, if the trace
+ * weight says utilization is scored.
+ * @param rss_kb_before mm_rss_begin() taken just before the replay.
+ */
+void mm_util_report(const mm_util_stats *u, const mm_trace_header *h,
+                    long rss_kb_before);
+
+#endif // _MM_UTIL_H
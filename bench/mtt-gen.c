@@ -0,0 +1,347 @@
+/**
+ * @file mtt-gen.c
+ * @brief Generator for synthetic multi-threaded traces.
+ *
+ * Writes "<tid> <op> <id> <size>" traces with the 4-line CS:APP header
+ * for the classic allocator stress patterns:
+ *
+ *   threadtest  every thread allocates a batch, then frees it
+ *   larson      threads keep a working set and replace random members,
+ *               some of which were allocated by other threads
+ *   prodcons    even threads allocate, odd threads free
+ *   bursty      all threads alternate between allocation-heavy and
+ *               free-heavy phases, and the size mix changes per phase
+ *
+ * The remote ratio (-r) is the fraction of frees issued by a thread other
+ * than the one that allocated the block. Ops are emitted in one global
+ * order that the drivers preserve per block id, so every trace replays
+ * without deadlock.
+ *
+ * Usage: mtt-gen -p pattern [-t threads] [-n ops] [-w working_set]
+ *                [-s dist] [-r remote_ratio] [-S seed] [-o out.rep]
+ * Size distributions: fixed:N, uniform:MIN:MAX, log:MIN:MAX.
+*/
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum pattern {THREADTEST, LARSON, PRODCONS, BURSTY};
+enum dist_kind {DIST_FIXED, DIST_UNIFORM, DIST_LOG};
+
+typedef struct {
+  enum dist_kind kind;
+  uint64_t min, max;
+} size_dist;
+
+typedef struct {
+  uint32_t id;
+  uint32_t owner;         /* thread that allocated it */
+  uint64_t size;
+} object;
+
+typedef struct {
+  uint16_t tid;
+  char op;
+  uint32_t id;
+  uint64_t size;
+} gen_op;
+
+/* Every live object, with swap-remove so picking one at random is O(1). */
+typedef struct {
+  object *objs;
+  size_t count, cap;
+} object_set;
+
+static gen_op *ops;
+static size_t num_ops, ops_cap;
+static uint32_t next_id;
+static uint64_t live_bytes, max_alloc;
+static uint64_t rng_state;
+
+static void *xrealloc(void *p, size_t size) {
+  if ((p = realloc(p, size)) == NULL) {
+    perror("mtt-gen");
+    exit(1);
+  }
+  return p;
+}
+
+/* xorshift64* */
+static uint64_t rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dUL;
+}
+
+static double rng_unit(void) {
+  return (rng() >> 11) * (1.0 / (1UL << 53));
+}
+
+static uint64_t rng_range(uint64_t lo, uint64_t hi) {
+  return lo + rng() % (hi - lo + 1);
+}
+
+static uint64_t draw_size(const size_dist *d, uint64_t scale) {
+  uint64_t size;
+  switch (d->kind) {
+    case DIST_FIXED:
+      size = d->min;
+      break;
+    case DIST_UNIFORM:
+      size = rng_range(d->min, d->max);
+      break;
+    default: { /* log-uniform: small sizes as likely per octave as large */
+      double lo = log((double)d->min);
+      double hi = log((double)d->max);
+      size = (uint64_t)exp(lo + (hi - lo) * rng_unit());
+      if (size < d->min) size = d->min;
+      if (size > d->max) size = d->max;
+    }
+  }
+  return size * scale;
+}
+
+static void emit(uint16_t tid, char op, uint32_t id, uint64_t size) {
+  if (num_ops == ops_cap) {
+    ops_cap = ops_cap ? 2 * ops_cap : 4096;
+    ops = xrealloc(ops, ops_cap * sizeof(gen_op));
+  }
+  ops[num_ops++] = (gen_op){.tid = tid, .op = op, .id = id, .size = size};
+}
+
+static object alloc_obj(uint32_t tid, uint64_t size) {
+  object o = {.id = next_id++, .owner = tid, .size = size};
+  emit(tid, 'a', o.id, size);
+  live_bytes += size;
+  if (live_bytes > max_alloc) max_alloc = live_bytes;
+  return o;
+}
+
+static void free_obj(uint32_t tid, object o) {
+  emit(tid, 'f', o.id, 0);
+  live_bytes -= o.size;
+}
+
+/* Thread that frees an object owned by `owner`: another one with
+   probability `remote`. */
+static uint32_t freeing_thread(uint32_t owner, uint32_t nthreads,
+                               double remote) {
+  if (nthreads < 2 || rng_unit() >= remote) return owner;
+  uint32_t t = rng_range(0, nthreads - 2);
+  return t >= owner ? t + 1 : t;
+}
+
+static void set_push(object_set *s, object o) {
+  if (s->count == s->cap) {
+    s->cap = s->cap ? 2 * s->cap : 64;
+    s->objs = xrealloc(s->objs, s->cap * sizeof(object));
+  }
+  s->objs[s->count++] = o;
+}
+
+static object set_take(object_set *s, size_t i) {
+  object o = s->objs[i];
+  s->objs[i] = s->objs[--s->count];
+  return o;
+}
+
+/* Each thread allocates `ws` objects, then frees them, round after round.
+   Threads take turns one op at a time. */
+static void gen_threadtest(uint32_t nthreads, size_t target, size_t ws,
+                           const size_dist *d, double remote) {
+  object_set batch[nthreads];
+  memset(batch, 0, sizeof(batch));
+  while (num_ops < target) {
+    for (size_t k = 0; k < ws; k++)
+      for (uint32_t t = 0; t < nthreads; t++)
+        set_push(&batch[t], alloc_obj(t, draw_size(d, 1)));
+    for (size_t k = 0; k < ws; k++)
+      for (uint32_t t = 0; t < nthreads; t++) {
+        object o = set_take(&batch[t], batch[t].count - 1);
+        free_obj(freeing_thread(t, nthreads, remote), o);
+      }
+  }
+  for (uint32_t t = 0; t < nthreads; t++) free(batch[t].objs);
+}
+
+/* Each thread keeps a working set; every step frees a random member and
+   allocates a replacement. With probability `remote` the replacement is
+   handed to another thread's set, as larson passes blocks between
+   threads, so that fraction of each set (and of frees) is foreign. */
+static void gen_larson(uint32_t nthreads, size_t target, size_t ws,
+                       const size_dist *d, double remote) {
+  object_set set[nthreads];
+  memset(set, 0, sizeof(set));
+  for (size_t k = 0; k < ws; k++)
+    for (uint32_t t = 0; t < nthreads; t++)
+      set_push(&set[t], alloc_obj(t, draw_size(d, 1)));
+  while (num_ops < target) {
+    for (uint32_t t = 0; t < nthreads; t++) {
+      uint32_t to = freeing_thread(t, nthreads, remote);
+      if (set[t].count > 0)
+        free_obj(t, set_take(&set[t], rng() % set[t].count));
+      set_push(&set[to], alloc_obj(t, draw_size(d, 1)));
+    }
+  }
+  for (uint32_t t = 0; t < nthreads; t++) {
+    while (set[t].count > 0) free_obj(t, set_take(&set[t], 0));
+    free(set[t].objs);
+  }
+}
+
+/* Even threads produce, the next odd thread consumes. Each consumer
+   lags its producer by up to `ws` objects. With remote < 1 some objects
+   are freed by their producer instead. */
+static void gen_prodcons(uint32_t nthreads, size_t target, size_t ws,
+                         const size_dist *d, double remote) {
+  uint32_t npairs = nthreads / 2 ? nthreads / 2 : 1;
+  object_set queue[npairs];
+  memset(queue, 0, sizeof(queue));
+  while (num_ops < target) {
+    for (uint32_t p = 0; p < npairs; p++) {
+      uint32_t prod = 2 * p, cons = nthreads > 1 ? 2 * p + 1 : 0;
+      set_push(&queue[p], alloc_obj(prod, draw_size(d, 1)));
+      if (queue[p].count > ws || rng_unit() < 0.5) {
+        /* oldest first, like a FIFO hand-off */
+        object o = queue[p].objs[0];
+        memmove(queue[p].objs, queue[p].objs + 1,
+                (queue[p].count - 1) * sizeof(object));
+        queue[p].count--;
+        free_obj(rng_unit() < remote ? cons : prod, o);
+      }
+    }
+  }
+  for (uint32_t p = 0; p < npairs; p++) {
+    for (size_t i = 0; i < queue[p].count; i++)
+      free_obj(nthreads > 1 ? 2 * p + 1 : 0, queue[p].objs[i]);
+    free(queue[p].objs);
+  }
+}
+
+/* Phases of growth to `ws` objects per thread and decay to a tenth of
+   that. Odd phases draw sizes 16x larger, so the class mix shifts. */
+static void gen_bursty(uint32_t nthreads, size_t target, size_t ws,
+                       const size_dist *d, double remote) {
+  object_set set[nthreads];
+  memset(set, 0, sizeof(set));
+  for (unsigned phase = 0; num_ops < target; phase++) {
+    uint64_t scale = phase % 2 ? 16 : 1;
+    bool grow;
+    for (size_t step = 0; step < 2 * ws && num_ops < target; step++) {
+      for (uint32_t t = 0; t < nthreads; t++) {
+        /* mostly allocate while growing, mostly free while shrinking */
+        grow = step < ws ? rng_unit() < 0.9 : rng_unit() < 0.1;
+        if (step >= ws && set[t].count <= ws / 10) grow = true;
+        if (grow || set[t].count == 0) {
+          set_push(&set[t], alloc_obj(t, draw_size(d, scale)));
+        } else {
+          object o = set_take(&set[t], rng() % set[t].count);
+          free_obj(freeing_thread(o.owner, nthreads, remote), o);
+        }
+      }
+    }
+  }
+  for (uint32_t t = 0; t < nthreads; t++) {
+    while (set[t].count > 0) {
+      object o = set_take(&set[t], 0);
+      free_obj(freeing_thread(o.owner, nthreads, remote), o);
+    }
+    free(set[t].objs);
+  }
+}
+
+static bool parse_dist(const char *s, size_dist *d) {
+  unsigned long a, b;
+  if (sscanf(s, "fixed:%lu", &a) == 1) {
+    *d = (size_dist){DIST_FIXED, a, a};
+  } else if (sscanf(s, "uniform:%lu:%lu", &a, &b) == 2) {
+    *d = (size_dist){DIST_UNIFORM, a, b};
+  } else if (sscanf(s, "log:%lu:%lu", &a, &b) == 2) {
+    *d = (size_dist){DIST_LOG, a, b};
+  } else {
+    return false;
+  }
+  return d->min > 0 && d->min <= d->max;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s -p threadtest|larson|prodcons|bursty [options]\n"
+    "  -t N     threads (default 4)\n"
+    "  -n N     approximate number of ops (default 100000)\n"
+    "  -w N     working set per thread (default 100)\n"
+    "  -s DIST  fixed:N, uniform:MIN:MAX or log:MIN:MAX (default log:8:512)\n"
+    "  -r R     fraction of frees done by another thread (default: 0 for\n"
+    "           threadtest, 0.5 for larson and bursty, 1 for prodcons)\n"
+    "  -S N     random seed (default 1)\n"
+    "  -o FILE  output (default stdout)\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  enum pattern pattern = THREADTEST;
+  bool have_pattern = false;
+  uint32_t nthreads = 4;
+  size_t target = 100000, ws = 100;
+  size_dist dist = {DIST_LOG, 8, 512};
+  double remote = -1;
+  const char *out_path = NULL;
+  int opt;
+
+  rng_state = 1;
+  while ((opt = getopt(argc, argv, "p:t:n:w:s:r:S:o:")) != -1) {
+    switch (opt) {
+      case 'p':
+        have_pattern = true;
+        if (!strcmp(optarg, "threadtest")) pattern = THREADTEST;
+        else if (!strcmp(optarg, "larson")) pattern = LARSON;
+        else if (!strcmp(optarg, "prodcons")) pattern = PRODCONS;
+        else if (!strcmp(optarg, "bursty")) pattern = BURSTY;
+        else usage(argv[0]);
+        break;
+      case 't': nthreads = strtoul(optarg, NULL, 0); break;
+      case 'n': target = strtoul(optarg, NULL, 0); break;
+      case 'w': ws = strtoul(optarg, NULL, 0); break;
+      case 's': if (!parse_dist(optarg, &dist)) usage(argv[0]); break;
+      case 'r': remote = strtod(optarg, NULL); break;
+      case 'S': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+      case 'o': out_path = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (!have_pattern || nthreads < 1 || nthreads > UINT16_MAX || ws < 1
+      || remote > 1)
+    usage(argv[0]);
+  if (remote < 0)
+    remote = pattern == THREADTEST ? 0 : pattern == PRODCONS ? 1 : 0.5;
+
+  switch (pattern) {
+    case THREADTEST: gen_threadtest(nthreads, target, ws, &dist, remote); break;
+    case LARSON: gen_larson(nthreads, target, ws, &dist, remote); break;
+    case PRODCONS: gen_prodcons(nthreads, target, ws, &dist, remote); break;
+    case BURSTY: gen_bursty(nthreads, target, ws, &dist, remote); break;
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  if (out == NULL) {
+    perror(out_path);
+    exit(1);
+  }
+  fprintf(out, "1\n%u\n%lu\n%lu\n", next_id, num_ops, max_alloc);
+  for (size_t i = 0; i < num_ops; i++) {
+    if (ops[i].op == 'f')
+      fprintf(out, "%u f %u\n", ops[i].tid, ops[i].id);
+    else
+      fprintf(out, "%u a %u %lu\n", ops[i].tid, ops[i].id, ops[i].size);
+  }
+  if (out != stdout) fclose(out);
+  free(ops);
+  return 0;
+}
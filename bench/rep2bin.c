@@ -0,0 +1,39 @@
+/**
+ * @file rep2bin.c
+ * @brief Convert a text .rep trace into the binary format of mm-trace.h.
+ *
+ * Usage: ./rep2bin <in.rep> <out.bin>
+*/
+
+#define _GNU_SOURCE
+#include "mm-trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+  mm_trace trace;
+  int fd;
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <in.rep> <out.bin>\n", argv[0]);
+    exit(1);
+  }
+  if (mm_trace_open(argv[1], &trace) < 0) {
+    fprintf(stderr, "rep2bin: cannot load %s (%s)\n", argv[1], strerror(errno));
+    exit(1);
+  }
+  fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || mm_trace_write(&trace, fd) < 0 || close(fd) < 0) {
+    fprintf(stderr, "rep2bin: cannot write %s (%s)\n", argv[2], strerror(errno));
+    exit(1);
+  }
+  fprintf(stderr, "%s: %lu ops, %lu ids, %u threads\n", argv[2],
+          trace.header->num_ops, trace.header->num_ids,
+          trace.header->num_threads);
+  mm_trace_close(&trace);
+  return 0;
+}
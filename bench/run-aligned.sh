@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# run-aligned.sh - thread-caching's pagemap lookup against its aligned
+# superblocks (-D_MMF_ALIGNED_SB).
+#
+# Replays the ngram and cbit traces, which are nearly all small objects,
+# under ../thread-caching/malloc.so and malloc-aligned.so (build them
+# with make malloc.so and make ALIGNED=1 there), one copy each, RUNS
+# times, alternating builds within a run so drift hits both alike. Writes
+# one CSV:
+#
+#   build,trace,run,threads,ops,seconds,ops_per_sec,peak_rss_kb
+#
+# bench-driver runs with -a, so traces of weight 0 are replayed too.
+#
+# Usage: ./run-aligned.sh [-r runs] [-o out.csv] [trace ...]
+# Defaults to ../thread-caching/traces/{ngram,cbit}-*.rep.
+
+set -e
+cd "$(dirname "$0")"
+
+BUILDS="malloc malloc-aligned"
+RUNS=9
+OUT=aligned.csv
+
+while getopts "r:o:" opt; do
+  case $opt in
+    r) RUNS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) echo "Usage: $0 [-r runs] [-o out.csv] [trace ...]" >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+TRACES=${*:-../thread-caching/traces/ngram-*.rep ../thread-caching/traces/cbit-*.rep}
+
+for build in $BUILDS; do
+  if [ ! -f "../thread-caching/$build.so" ]; then
+    echo "../thread-caching/$build.so not built" >&2
+    exit 1
+  fi
+done
+
+RAW=$(mktemp)
+trap 'rm -f "$RAW"' EXIT
+
+for trace in $TRACES; do
+  name=$(basename "$trace" .rep)
+  for ((run = 1; run <= RUNS; run++)); do
+    for build in $BUILDS; do
+      status=0
+      row=$(LD_PRELOAD=../thread-caching/$build.so ./bench-driver -a -p \
+            "$trace" 2>/dev/null) || status=$?
+      if [ $status -ne 0 ]; then
+        echo "$build $name run=$run: failed ($status)" >&2
+        continue
+      fi
+      # bench-driver prints threads,ops,seconds,ops_per_sec,peak_rss_kb
+      echo "$build,$name,$run,$row" >> "$RAW"
+    done
+  done
+  echo "$name done" >&2
+done
+
+{
+  echo "build,trace,run,threads,ops,seconds,ops_per_sec,peak_rss_kb"
+  cat "$RAW"
+} > "$OUT"
+
+echo "wrote $OUT" >&2
@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# run-false-sharing.sh - false-sharing sweep across all allocator variants.
+#
+# Runs each false-share mode under glibc and under each variant's
+# malloc.so (via LD_PRELOAD) with 1, 2, 4, ... up to the number of online
+# cores, RUNS times each, and writes one CSV:
+#
+#   variant,run,mode,threads,size,iterations,writes,seconds,ops_per_sec,
+#   llc_misses,shared_lines,speedup,hitm
+#
+# speedup is ops_per_sec divided by the mean single-thread ops_per_sec of
+# the same variant and mode; an allocator that induces false sharing
+# stays near 1. hitm is the local plus remote HITM count from
+# `perf c2c` when -c is given, and empty otherwise.
+#
+# Usage: ./run-false-sharing.sh [-r runs] [-s size] [-i iterations] [-c]
+#                               [-o out.csv]
+
+set -e
+cd "$(dirname "$0")"
+
+VARIANTS="single-lock multiple-heaps thread-caching"
+MODES="active-false passive-false cache-scratch"
+RUNS=3
+SIZE=8
+ITERS=100000
+C2C=0
+OUT=false-sharing.csv
+
+while getopts "r:s:i:co:" opt; do
+  case $opt in
+    r) RUNS=$OPTARG ;;
+    s) SIZE=$OPTARG ;;
+    i) ITERS=$OPTARG ;;
+    c) C2C=1 ;;
+    o) OUT=$OPTARG ;;
+    *) echo "Usage: $0 [-r runs] [-s size] [-i iterations] [-c] [-o out.csv]" >&2
+       exit 1 ;;
+  esac
+done
+if [ $C2C -eq 1 ] && ! command -v perf >/dev/null; then
+  echo "$0: perf not found, ignoring -c" >&2
+  C2C=0
+fi
+
+NCPU=$(nproc)
+THREADS=""
+for ((t = 1; t < NCPU; t *= 2)); do THREADS="$THREADS $t"; done
+THREADS="$THREADS $NCPU"
+
+RAW=$(mktemp)
+C2CDATA=$(mktemp)
+trap 'rm -f "$RAW" "$C2CDATA"' EXIT
+
+for mode in $MODES; do
+  for variant in glibc $VARIANTS; do
+    preload=""
+    [ "$variant" != glibc ] && preload="../$variant/malloc.so"
+    for t in $THREADS; do
+      for ((run = 1; run <= RUNS; run++)); do
+        cmd="./false-share -p -m $mode -t $t -s $SIZE -i $ITERS"
+        hitm=""
+        if [ $C2C -eq 1 ]; then
+          # preload into the benchmark only, not perf itself
+          row=$(perf c2c record -q -o "$C2CDATA" -- \
+                env LD_PRELOAD=$preload $cmd 2>/dev/null) ||
+            { echo "$variant $mode t=$t: failed" >&2; continue; }
+          hitm=$(perf c2c report -i "$C2CDATA" --stats 2>/dev/null |
+                 awk -F: '/Load (Local|Remote) HITM/ { n += $2 } END { print n + 0 }')
+        else
+          row=$(LD_PRELOAD=$preload $cmd 2>/dev/null) ||
+            { echo "$variant $mode t=$t: failed" >&2; continue; }
+        fi
+        echo "$variant,$run,$row,$hitm" >> "$RAW"
+      done
+    done
+    echo "$variant $mode done" >&2
+  done
+done
+
+# two passes over the raw rows: single-thread means, then speedups
+awk -F, -v OFS=, '
+  NR == FNR {
+    if ($4 == 1) { sum[$1 FS $3] += $9; n[$1 FS $3]++ }
+    next
+  }
+  FNR == 1 {
+    print "variant,run,mode,threads,size,iterations,writes,seconds,ops_per_sec,llc_misses,shared_lines,speedup,hitm"
+  }
+  {
+    k = $1 FS $3
+    base = n[k] ? sum[k] / n[k] : 0
+    print $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, (base ? sprintf("%.3f", $9 / base) : ""), $12
+  }' "$RAW" "$RAW" > "$OUT"
+
+echo "wrote $OUT" >&2
@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# run-scaling.sh - thread-scaling sweep across all allocator variants.
+#
+# Replays every trace under glibc and under each variant's malloc.so
+# (via LD_PRELOAD) with 1, 2, 4, ... up to the number of online cores,
+# RUNS times each, and writes one CSV:
+#
+#   variant,trace,copies,threads,run,ops,seconds,ops_per_sec,speedup,peak_rss_kb
+#
+# copies is the bench-driver -t value; threads is copies times the number
+# of tids in the trace. speedup is ops_per_sec divided by the mean
+# single-copy ops_per_sec of the same variant on the same trace. Traces
+# with weight 0 are skipped.
+#
+# Usage: ./run-scaling.sh [-r runs] [-o out.csv] [trace ...]
+# Defaults to every trace in ../multiple-heaps/traces.
+
+set -e
+cd "$(dirname "$0")"
+
+VARIANTS="single-lock multiple-heaps thread-caching"
+RUNS=3
+OUT=scaling.csv
+
+while getopts "r:o:" opt; do
+  case $opt in
+    r) RUNS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) echo "Usage: $0 [-r runs] [-o out.csv] [trace ...]" >&2; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+TRACES=${*:-../multiple-heaps/traces/*.rep}
+
+NCPU=$(nproc)
+THREADS=""
+for ((t = 1; t < NCPU; t *= 2)); do THREADS="$THREADS $t"; done
+THREADS="$THREADS $NCPU"
+
+RAW=$(mktemp)
+trap 'rm -f "$RAW"' EXIT
+
+for trace in $TRACES; do
+  name=$(basename "$trace" .rep)
+  for variant in glibc $VARIANTS; do
+    preload=""
+    [ "$variant" != glibc ] && preload="../$variant/malloc.so"
+    for t in $THREADS; do
+      for ((run = 1; run <= RUNS; run++)); do
+        status=0
+        row=$(LD_PRELOAD=$preload ./bench-driver -p -t "$t" "$trace" \
+              2>/dev/null) || status=$?
+        if [ $status -eq 3 ]; then
+          continue 4 # weight 0, skip the whole trace
+        elif [ $status -ne 0 ]; then
+          echo "$variant $name t=$t run=$run: failed ($status)" >&2
+          continue
+        fi
+        # bench-driver prints threads,ops,seconds,ops_per_sec,peak_rss_kb
+        echo "$variant,$name,$t,${row%%,*},$run,${row#*,}" >> "$RAW"
+      done
+    done
+    echo "$variant $name done" >&2
+  done
+done
+
+# two passes over the raw rows: single-thread means, then speedups
+awk -F, -v OFS=, '
+  NR == FNR {
+    if ($3 == 1) { sum[$1 FS $2] += $8; n[$1 FS $2]++ }
+    next
+  }
+  FNR == 1 {
+    print "variant,trace,copies,threads,run,ops,seconds,ops_per_sec,speedup,peak_rss_kb"
+  }
+  {
+    k = $1 FS $2
+    base = n[k] ? sum[k] / n[k] : 0
+    print $1, $2, $3, $4, $5, $6, $7, $8, (base ? sprintf("%.3f", $8 / base) : ""), $9
+  }' "$RAW" "$RAW" > "$OUT"
+
+echo "wrote $OUT" >&2
@@ -0,0 +1,277 @@
+/**
+ * @file thread-churn.c
+ * @brief Larson-style server benchmark with continuous thread turnover.
+ *
+ * -t slots each hold a set of -o live objects. The thread in a slot
+ * replaces random objects of its set (free, then malloc of a random
+ * size) -n times, then spawns its successor and exits. The successor
+ * inherits the set, so every object is freed by a different thread than
+ * the one that allocated it, and the allocator sees a new thread every
+ * few milliseconds. The run ends after -g threads in total.
+ *
+ * While the workers run, the main thread prints one CSV row per interval:
+ *   seconds,threads_started,threads_exited,ops,ops_per_sec,rss_kb
+ * and a summary on stderr, including the latency of each thread's first
+ * malloc (which pays for per-thread heap or cache setup) next to the
+ * mean steady-state cost of a free/malloc pair.
+ *
+ * An allocator that leaks thread ids fails once enough threads have come
+ * and gone: malloc returning NULL, or no progress for -T seconds, is
+ * reported with the number of threads started so far and exit status 2.
+ * Like bench-driver, only the standard malloc API is used.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPS_FLUSH (1024) /* ops between updates of the shared counter */
+
+typedef struct {
+  void **objs;               /* this slot's set, inherited across threads */
+  uint64_t rng;
+  uint64_t thread;           /* index of the thread now in the slot */
+} slot_state;
+
+static size_t nslots = 4;
+static size_t set_size = 1000;
+static size_t ops_per_thread = 10000;
+static size_t total_threads = 1000;
+static size_t min_size = 8, max_size = 64;
+
+static slot_state *slots;
+
+/* shared counters, all updated atomically */
+static uint64_t threads_started, threads_exited, ops_done;
+static uint64_t first_mallocs, first_malloc_ns_sum, first_malloc_ns_max;
+static uint64_t steady_ns_sum, steady_ops;
+static uint64_t failed_thread; /* 1 + index of the failing thread, or 0 */
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t next_rand(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1dUL;
+}
+
+static size_t rand_size(uint64_t *s) {
+  return min_size + next_rand(s) % (max_size - min_size + 1);
+}
+
+static void *checked_malloc(size_t size, uint64_t thread) {
+  char *p = malloc(size);
+  if (p == NULL) {
+    uint64_t expected = 0;
+    __atomic_compare_exchange_n(&failed_thread, &expected, thread + 1, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  p[0] = (char)size; /* touch it */
+  return p;
+}
+
+static bool spawn(size_t slot);
+
+static void *worker(void *argvp) {
+  size_t slot = (uintptr_t)argvp;
+  slot_state *st = &slots[slot];
+  uint64_t thread = st->thread;
+  uint64_t t0, t1, t2;
+  size_t i, pending = 0;
+
+  /* the first malloc of a thread pays for its heap/cache setup */
+  t0 = now_ns();
+  void *first = checked_malloc(rand_size(&st->rng), thread);
+  t1 = now_ns();
+  if (first == NULL) goto exit;
+  __atomic_fetch_add(&first_mallocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&first_malloc_ns_sum, t1 - t0, __ATOMIC_RELAXED);
+  for (uint64_t m = __atomic_load_n(&first_malloc_ns_max, __ATOMIC_RELAXED);
+       t1 - t0 > m &&
+       !__atomic_compare_exchange_n(&first_malloc_ns_max, &m, t1 - t0, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);) {
+  }
+  free(first);
+
+  for (i = 0; i < ops_per_thread; i++) {
+    size_t k = next_rand(&st->rng) % set_size;
+    free(st->objs[k]);
+    if ((st->objs[k] = checked_malloc(rand_size(&st->rng), thread)) == NULL)
+      goto exit;
+    if (++pending == OPS_FLUSH) {
+      __atomic_fetch_add(&ops_done, pending, __ATOMIC_RELAXED);
+      pending = 0;
+    }
+  }
+  t2 = now_ns();
+  __atomic_fetch_add(&ops_done, pending, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&steady_ns_sum, t2 - t1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&steady_ops, ops_per_thread, __ATOMIC_RELAXED);
+  spawn(slot);
+exit:
+  __atomic_fetch_add(&threads_exited, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Start the next thread in a slot, unless the run is over. */
+static bool spawn(size_t slot) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  uint64_t n = __atomic_fetch_add(&threads_started, 1, __ATOMIC_RELAXED);
+  if (n >= total_threads || __atomic_load_n(&failed_thread, __ATOMIC_RELAXED)) {
+    __atomic_fetch_sub(&threads_started, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  slots[slot].thread = n;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, worker, (void *)(uintptr_t)slot) != 0) {
+    fprintf(stderr, "thread-churn: cannot create thread %lu\n", n);
+    exit(1);
+  }
+  pthread_attr_destroy(&attr);
+  return true;
+}
+
+static long rss_kb(void) {
+  char buf[64];
+  long pages = 0;
+  ssize_t n;
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0) return 0;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 0;
+  buf[n] = '\0';
+  if (sscanf(buf, "%*s %ld", &pages) != 1) return 0;
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void *driver_mmap(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("thread-churn: mmap");
+    exit(1);
+  }
+  return p;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-t slots] [-o objects] [-n ops] [-g threads] "
+          "[-s min:max] [-i ms] [-T secs]\n"
+          "  -t N    concurrently running threads (default 4)\n"
+          "  -o N    live objects per slot (default 1000)\n"
+          "  -n N    replacements per thread before it exits (default 10000)\n"
+          "  -g N    threads to run in total (default 1000)\n"
+          "  -s A:B  object sizes, uniform in [A, B] (default 8:64)\n"
+          "  -i N    sampling interval in ms (default 100)\n"
+          "  -T N    give up after N seconds without progress (default 10)\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  long interval_ms = 100, stall_secs = 10;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:o:n:g:s:i:T:")) != -1) {
+    switch (opt) {
+      case 't': nslots = strtoul(optarg, NULL, 0); break;
+      case 'o': set_size = strtoul(optarg, NULL, 0); break;
+      case 'n': ops_per_thread = strtoul(optarg, NULL, 0); break;
+      case 'g': total_threads = strtoul(optarg, NULL, 0); break;
+      case 's':
+        if (sscanf(optarg, "%lu:%lu", &min_size, &max_size) != 2)
+          usage(argv[0]);
+        break;
+      case 'i': interval_ms = atol(optarg); break;
+      case 'T': stall_secs = atol(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || nslots == 0 || set_size == 0 ||
+      total_threads < nslots || min_size == 0 || max_size < min_size ||
+      interval_ms <= 0 || stall_secs <= 0)
+    usage(argv[0]);
+
+  /* the first generation's sets come from the main thread */
+  slots = driver_mmap(nslots * sizeof(slot_state));
+  for (size_t s = 0; s < nslots; s++) {
+    slots[s].objs = driver_mmap(set_size * sizeof(void *));
+    slots[s].rng = 0x9e3779b97f4a7c15UL * (s + 1);
+    for (size_t k = 0; k < set_size; k++) {
+      if ((slots[s].objs[k] = checked_malloc(rand_size(&slots[s].rng), 0))
+          == NULL) {
+        fprintf(stderr, "thread-churn: malloc failed in the main thread\n");
+        exit(1);
+      }
+    }
+  }
+
+  uint64_t start = now_ns(), last = start, last_ops = 0;
+  uint64_t progress = 0, progress_at = start;
+  long peak_rss = rss_kb();
+  printf("seconds,threads_started,threads_exited,ops,ops_per_sec,rss_kb\n");
+  for (size_t s = 0; s < nslots; s++) spawn(s);
+
+  struct timespec nap = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+  for (;;) {
+    nanosleep(&nap, NULL);
+    uint64_t t = now_ns();
+    uint64_t started = __atomic_load_n(&threads_started, __ATOMIC_RELAXED);
+    uint64_t exited = __atomic_load_n(&threads_exited, __ATOMIC_ACQUIRE);
+    uint64_t ops = __atomic_load_n(&ops_done, __ATOMIC_RELAXED);
+    long rss = rss_kb();
+    if (rss > peak_rss) peak_rss = rss;
+    printf("%.3f,%lu,%lu,%lu,%.0f,%ld\n", (t - start) / 1e9, started, exited,
+           ops, (ops - last_ops) / ((t - last) / 1e9), rss);
+    fflush(stdout);
+    last = t;
+    last_ops = ops;
+
+    if (started == exited) break; /* every slot has run out or failed */
+    if (ops + exited != progress) {
+      progress = ops + exited;
+      progress_at = t;
+    } else if (t - progress_at > (uint64_t)stall_secs * 1000000000UL) {
+      fprintf(stderr, "thread-churn: no progress for %ld s after %lu threads "
+              "started (%lu exited)\n", stall_secs, started, exited);
+      _exit(2); /* workers may be blocked inside the allocator */
+    }
+  }
+
+  double secs = (now_ns() - start) / 1e9;
+  uint64_t exited = __atomic_load_n(&threads_exited, __ATOMIC_ACQUIRE);
+  fprintf(stderr, "threads     %lu in %.3f s (%.0f/s)\n", exited, secs,
+          exited / secs);
+  fprintf(stderr, "throughput  %lu ops, %.0f ops/s\n", ops_done,
+          ops_done / secs);
+  fprintf(stderr, "first malloc of a thread  mean %.0f ns  max %lu ns\n",
+          first_mallocs ? (double)first_malloc_ns_sum / first_mallocs : 0.0, first_malloc_ns_max);
+  fprintf(stderr, "steady free+malloc pair   mean %.0f ns\n",
+          steady_ops ? (double)steady_ns_sum / steady_ops : 0.0);
+  fprintf(stderr, "peak RSS    %ld kB\n", peak_rss);
+  if (failed_thread) {
+    fprintf(stderr, "thread-churn: malloc failed in thread %lu\n",
+            failed_thread - 1);
+    return 2;
+  }
+  return 0;
+}
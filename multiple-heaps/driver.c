@@ -7,84 +7,132 @@
 // TODO: make into one include file
 #include "src/mm-frontend.h"
 #include "src/mm-backend.h"
+#include "src/mm-frontend-aux.h"
+#include "../bench/mm-hist.h"
+#include "../bench/mm-payload.h"
+#include "../bench/mm-trace.h"
+#include "../bench/mm-util.h"
 #include <getopt.h>
 
-#define TRACE_READ_LINELEN 50
-
-typedef enum {
-  MALLOC,
-  FREE,
-  REALLOC,
-  CALLOC
-} mm_alloc_type;
-
-typedef struct {
-  uint64_t block_tag;
-  size_t alloc_size;
-  mm_alloc_type alloc_type;
-  uint16_t tid;
-} mm_driver_action;
+#define DRIVER_REGION_SIZE (1UL << 32) /* reserved, not committed */
 
 typedef struct {
   void **ptrs;
-  mm_driver_action *actions;
-  int num_actions;
+  size_t *sizes;
+  const mm_trace_op *ops;
+  size_t num_ops;
 } runtrace_arg;
 
-void parse_trace(char *buf, FILE *trace, mm_driver_action *actions) {
-  char c;
-  size_t id;
-  size_t size;
-  char rest[TRACE_READ_LINELEN];
-  size_t pos = 0;
-  while (fgets(buf, TRACE_READ_LINELEN + 1, trace) != NULL) {
-    if (strlen(buf) < 2) {
-      return;
-    }
-    sscanf(buf, "%c %s", &c, rest);
-    switch(c) {
-      case 'a':
-        sscanf(buf, "%c %lu %lu", &c, &id, &size);
-        actions[pos].alloc_type = MALLOC;
-        actions[pos].block_tag = id;
-        actions[pos++].alloc_size = size;
-        break;
-      case 'f':
-        sscanf(buf, "%c %lu", &c, &id);
-        actions[pos].alloc_type = FREE;
-        actions[pos++].block_tag = id;
-        break;
-      case 'r':
-      case 'c':
-      default:
-        continue;
-    }
+/* Bump allocator over a private mapping, so the driver's own arrays
+   never come from the allocator under test or from the stack. */
+static unsigned char *driver_region = NULL;
+static size_t driver_region_used = 0;
+
+static void *driver_alloc(size_t size) {
+  void *ret;
+  if (driver_region == NULL) {
+    driver_region = mmap(NULL, DRIVER_REGION_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    io_msafe_assert(driver_region != MAP_FAILED);
   }
-  return;
+  size = (size + 15) & ~15UL;
+  io_msafe_assert(driver_region_used + size <= DRIVER_REGION_SIZE);
+  ret = driver_region + driver_region_used;
+  driver_region_used += size;
+  return ret; /* anonymous mapping is already zeroed */
+}
+
+static mm_latency_stats latency;
+static mm_util_stats util;
+
+/* Size of the heap block backing p, header included. */
+static size_t block_size(void *p) {
+  return p ? get_size(payload_to_header(p)) : 0;
 }
 
 void *runtrace(void *arg) {
   runtrace_arg *rt_arg = (runtrace_arg *)arg;
-  int num_actions = rt_arg->num_actions;
-  mm_driver_action *actions = rt_arg->actions;
+  size_t num_ops = rt_arg->num_ops;
+  const mm_trace_op *ops = rt_arg->ops;
   void **ptrs = rt_arg->ptrs;
-  for (int i = 0; i < num_actions; i++) {
+  size_t *sizes = rt_arg->sizes;
+  uint64_t start;
+  size_t block, old_size, keep, bad;
+  for (size_t i = 0; i < num_ops; i++) {
     void *xalloc_return;
-    mm_driver_action op = actions[i];
-    switch (op.alloc_type) {
-      case MALLOC:
-      case CALLOC:
-      case REALLOC:
-        xalloc_return = malloc(op.alloc_size);
-        if (xalloc_return == NULL && op.alloc_size != 0) {
+    const mm_trace_op *op = &ops[i];
+    switch (op->op) {
+      case MM_TRACE_ALLOC:
+        start = mm_rdtsc();
+        xalloc_return = malloc(op->size);
+        mm_latency_record(&latency, MM_OP_MALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
           io_msafe_eprintf("driver: malloc failed.\n");
           exit(1);
         }
-        ptrs[op.block_tag] = xalloc_return;
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
+        mm_util_alloc(&util, op->size, block_size(xalloc_return),
+                      thread_current_arena_usage());
+        break;
+      case MM_TRACE_FREE:
+        block = block_size(ptrs[op->id]);
+        start = mm_rdtsc();
+        free(ptrs[op->id]);
+        mm_latency_record(&latency, MM_OP_FREE, sizes[op->id],
+                          mm_rdtsc() - start);
+        mm_util_free(&util, sizes[op->id], block);
+        ptrs[op->id] = NULL;
+        break;
+      case MM_TRACE_REALLOC:
+        old_size = ptrs[op->id] ? sizes[op->id] : 0;
+        block = block_size(ptrs[op->id]);
+        start = mm_rdtsc();
+        xalloc_return = realloc(ptrs[op->id], op->size);
+        mm_latency_record(&latency, MM_OP_REALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
+          io_msafe_eprintf("driver: realloc failed.\n");
+          exit(1);
+        }
+        /* the prefix both blocks share must survive the move */
+        keep = old_size < op->size ? old_size : op->size;
+        mm_latency_record_bytes(&latency, MM_OP_REALLOC, keep);
+        if ((bad = mm_payload_check(xalloc_return, keep, op->id)) < keep) {
+          io_msafe_eprintf("driver: realloc of id %u lost byte %lu.\n",
+                           op->id, bad);
+          exit(1);
+        }
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
+        mm_util_free(&util, old_size, block);
+        mm_util_alloc(&util, op->size, block_size(xalloc_return),
+                      thread_current_arena_usage());
         break;
-      case FREE:
-        free(ptrs[op.block_tag]);
-        ptrs[op.block_tag] = NULL;
+      case MM_TRACE_CALLOC:
+        start = mm_rdtsc();
+        xalloc_return = calloc(1, op->size);
+        mm_latency_record(&latency, MM_OP_CALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
+          io_msafe_eprintf("driver: calloc failed.\n");
+          exit(1);
+        }
+        mm_latency_record_bytes(&latency, MM_OP_CALLOC, op->size);
+        if ((bad = mm_payload_check_zero(xalloc_return, op->size))
+            < op->size) {
+          io_msafe_eprintf("driver: calloc of id %u left byte %lu set.\n",
+                           op->id, bad);
+          exit(1);
+        }
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
+        mm_util_alloc(&util, op->size, block_size(xalloc_return),
+                      thread_current_arena_usage());
         break;
       default:
       io_msafe_eprintf("Driver: Invalid operation.\n");
@@ -99,11 +147,10 @@ void cleanup(void) {
 }
 
 int main (int argc, char **argv) {
-  mm_driver_action *actions;
-  FILE *trace;
-  char trace_read_buf[TRACE_READ_LINELEN];
-  int num_allocs, num_actions;
+  mm_trace trace;
+  size_t num_allocs;
   void **ptrs;
+  size_t *sizes;
 
   if (argc < 2) {
     io_msafe_eprintf("Usage: ./driver <trace>\n");
@@ -111,30 +158,25 @@ int main (int argc, char **argv) {
   }
   atexit(cleanup);
   
-  trace = fopen(argv[1], "r");
-  io_msafe_assert(trace != NULL);
-
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace); // first line
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace);
-  io_msafe_assert(sscanf(trace_read_buf, "%d", &num_allocs) == 1);
-
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace);
-  io_msafe_assert(sscanf(trace_read_buf, "%d", &num_actions) == 1);
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace); // heapsize line; ignore
-
-  actions = alloca(num_actions * sizeof(mm_driver_action));
-  io_msafe_assert(actions != NULL);
-
-  ptrs = alloca(num_allocs * sizeof(void *));
-  io_msafe_assert(ptrs != NULL);
+  if (mm_trace_open(argv[1], &trace) < 0) {
+    io_msafe_eprintf("driver: cannot load trace %s (%s).\n", argv[1],
+                     strerror(errno));
+    exit(1);
+  }
+  num_allocs = trace.header->num_ids;
 
-  parse_trace(trace_read_buf, trace, actions);
-  fclose(trace);
+  ptrs = driver_alloc(num_allocs * sizeof(void *));
+  sizes = driver_alloc(num_allocs * sizeof(size_t));
 
   pthread_t tid;
-  runtrace_arg arg = {.actions = actions, .ptrs = ptrs, .num_actions = num_actions};
+  long rss_before = mm_rss_begin();
+  runtrace_arg arg = {.ops = trace.ops, .ptrs = ptrs, .sizes = sizes,
+                      .num_ops = trace.header->num_ops};
   // runtrace((void*)&arg);
   pthread_create(&tid, NULL, runtrace, (void *)&arg);
   pthread_join(tid, NULL);
+  mm_latency_report(&latency);
+  mm_util_report(&util, trace.header, rss_before);
+  mm_trace_close(&trace);
   return 0;
 }
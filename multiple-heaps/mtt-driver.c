@@ -1,102 +1,181 @@
 /**
- * @file driver.c
+ * @file mtt-driver.c
  * @author Makoto Tomokiyo <mtomokiy@andrew.cmu.edu>
- * @brief A driver program to evaluate the allocator
+ * @brief A driver program to evaluate the allocator on multi-threaded traces.
+ *
+ * Each trace tid is replayed on its own pthread. All threads are released
+ * together from a start barrier. An operation on a block id waits until
+ * the previous operation on that id (in trace order) has completed, so a
+ * cross-thread free never runs before the matching allocation.
+ *
+ * Driver bookkeeping (op lists, ptrs, ready flags) lives in a private mmap
+ * region, so the allocator under test only sees trace traffic. The trace
+ * itself is replayed straight out of its mapping (see bench/mm-trace.h).
 */
 
 // TODO: make into one include file
 #include "src/mm-frontend.h"
 #include "src/mm-backend.h"
+#include "../bench/mm-hist.h"
+#include "../bench/mm-payload.h"
+#include "../bench/mm-trace.h"
 #include <getopt.h>
+#include <sched.h>
+#include <time.h>
 
-#define TRACE_READ_LINELEN 50
-
-typedef enum {
-  MALLOC,
-  FREE,
-  REALLOC,
-  CALLOC
-} mm_alloc_type;
-
-typedef struct {
-  uint64_t block_tag;
-  size_t alloc_size;
-  mm_alloc_type alloc_type;
-  uint16_t tid;
-} mm_driver_action;
+#define DRIVER_REGION_SIZE (1UL << 32) /* reserved, not committed */
+#define WAIT_SPINS (1024)
 
 typedef struct {
-  mm_driver_action **act;
-  int nops;
+  uint32_t *op_index;        /* this thread's ops, as indices into ops */
+  size_t nops;
+  mm_latency_stats *latency;
+  struct timespec start, end;  /* this thread's replay window */
 } runtrace_arg;
 
-void **ptrs;
-
-size_t parse_trace(char *buf, FILE *trace, mm_driver_action *actions,
-                int *ops_per_thread) {
-  char c;
-  int tid;
-  size_t id, size, nthreads = 0;
-  char rest[TRACE_READ_LINELEN];
-  size_t pos = 0;
-  while (fgets(buf, TRACE_READ_LINELEN + 1, trace) != NULL) {
-    if (strlen(buf) < 2) {
-      exit(1);
-    }
-    sscanf(buf, "%d %c %s", &tid, &c, rest);
-    nthreads = nthreads > tid ? nthreads : tid;
-    ops_per_thread[tid]++;
-    switch(c) {
-      case 'a':
-        sscanf(buf, "%d %c %lu %lu", &tid, &c, &id, &size);
-        actions[pos].alloc_type = MALLOC;
-        actions[pos].block_tag = id;
-        actions[pos].tid = tid;
-        actions[pos++].alloc_size = size;
-        break;
-      case 'f':
-        sscanf(buf, "%d %c %lu", &tid, &c, &id);
-        actions[pos].alloc_type = FREE;
-        actions[pos].tid = tid;
-        actions[pos++].block_tag = id;
-        break;
-      case 'r':
-      case 'c':
-      default:
-        continue;
-    }
+static const mm_trace_op *ops;
+static void **ptrs;
+static size_t *sizes;
+static uint32_t *ready;      /* per-id count of completed ops */
+static uint32_t *wait_seq;   /* per-op value of ready[id] it must observe */
+static pthread_barrier_t start_barrier;
+
+/* Bump allocator over a private mapping, so we never call malloc. */
+static unsigned char *driver_region = NULL;
+static size_t driver_region_used = 0;
+
+static void *driver_alloc(size_t size) {
+  void *ret;
+  if (driver_region == NULL) {
+    driver_region = mmap(NULL, DRIVER_REGION_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    io_msafe_assert(driver_region != MAP_FAILED);
   }
-  return nthreads;
+  size = (size + 15) & ~15UL;
+  io_msafe_assert(driver_region_used + size <= DRIVER_REGION_SIZE);
+  ret = driver_region + driver_region_used;
+  driver_region_used += size;
+  return ret; /* anonymous mapping is already zeroed */
+}
+
+/* Number every op on an id in trace order; split ops by tid. */
+static void split_trace(const mm_trace_header *h, runtrace_arg *args) {
+  uint32_t *id_seq = driver_alloc(h->num_ids * sizeof(uint32_t));
+  size_t count[h->num_threads];
+
+  memset(count, 0, sizeof(count));
+  for (size_t i = 0; i < h->num_ops; i++) {
+    wait_seq[i] = id_seq[ops[i].id]++;
+    count[ops[i].tid]++;
+  }
+  for (uint32_t t = 0; t < h->num_threads; t++) {
+    args[t].op_index = driver_alloc(count[t] * sizeof(uint32_t));
+    args[t].nops = 0;
+  }
+  for (size_t i = 0; i < h->num_ops; i++) {
+    runtrace_arg *arg = &args[ops[i].tid];
+    arg->op_index[arg->nops++] = i;
+  }
+}
+
+/* Spin until every earlier op on this id has completed. Yield after a
+   while, since the thread we wait on may be waiting for a CPU. */
+static inline void wait_for_id(uint32_t idx) {
+  for (unsigned spins = 0;
+       __atomic_load_n(&ready[ops[idx].id], __ATOMIC_ACQUIRE) != wait_seq[idx];
+       spins++) {
+    if (spins < WAIT_SPINS) _mm_pause();
+    else sched_yield();
+  }
+}
+
+static inline void signal_id(uint32_t idx) {
+  __atomic_store_n(&ready[ops[idx].id], wait_seq[idx] + 1, __ATOMIC_RELEASE);
 }
 
 void *runtrace(void *argvp) {
   runtrace_arg *arg = (runtrace_arg *)argvp;
-  mm_driver_action **actions = arg->act;
-  int num_actions = arg->nops;
+  uint32_t *op_index = arg->op_index;
+  size_t num_ops = arg->nops;
+  mm_latency_stats *latency = arg->latency;
+  uint64_t start;
+  size_t old_size, keep, bad;
 
-  for (int i = 0; i < num_actions; i++) {
+  pthread_barrier_wait(&start_barrier);
+  clock_gettime(CLOCK_MONOTONIC, &arg->start);
+  for (size_t i = 0; i < num_ops; i++) {
     void *xalloc_return;
-    mm_driver_action *op = actions[i];
-    switch (op->alloc_type) {
-      case MALLOC:
-      case CALLOC:
-      case REALLOC:
-        xalloc_return = malloc(op->alloc_size);
-        if (xalloc_return == NULL && op->alloc_size != 0) {
+    const mm_trace_op *op = &ops[op_index[i]];
+    wait_for_id(op_index[i]);
+    switch (op->op) {
+      case MM_TRACE_ALLOC:
+        start = mm_rdtsc();
+        xalloc_return = malloc(op->size);
+        mm_latency_record(latency, MM_OP_MALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
           io_msafe_eprintf("driver: malloc failed.\n");
           exit(1);
         }
-        ptrs[op->block_tag] = xalloc_return;
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
+        break;
+      case MM_TRACE_FREE:
+        start = mm_rdtsc();
+        free(ptrs[op->id]);
+        mm_latency_record(latency, MM_OP_FREE, sizes[op->id],
+                          mm_rdtsc() - start);
+        ptrs[op->id] = NULL;
         break;
-      case FREE:
-        free(ptrs[op->block_tag]);
-        ptrs[op->block_tag] = NULL;
+      case MM_TRACE_REALLOC:
+        old_size = ptrs[op->id] ? sizes[op->id] : 0;
+        start = mm_rdtsc();
+        xalloc_return = realloc(ptrs[op->id], op->size);
+        mm_latency_record(latency, MM_OP_REALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
+          io_msafe_eprintf("driver: realloc failed.\n");
+          exit(1);
+        }
+        keep = old_size < op->size ? old_size : op->size;
+        mm_latency_record_bytes(latency, MM_OP_REALLOC, keep);
+        if ((bad = mm_payload_check(xalloc_return, keep, op->id)) < keep) {
+          io_msafe_eprintf("driver: realloc of id %u lost byte %lu.\n",
+                           op->id, bad);
+          exit(1);
+        }
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
+        break;
+      case MM_TRACE_CALLOC:
+        start = mm_rdtsc();
+        xalloc_return = calloc(1, op->size);
+        mm_latency_record(latency, MM_OP_CALLOC, op->size,
+                          mm_rdtsc() - start);
+        if (xalloc_return == NULL && op->size != 0) {
+          io_msafe_eprintf("driver: calloc failed.\n");
+          exit(1);
+        }
+        mm_latency_record_bytes(latency, MM_OP_CALLOC, op->size);
+        if ((bad = mm_payload_check_zero(xalloc_return, op->size))
+            < op->size) {
+          io_msafe_eprintf("driver: calloc of id %u left byte %lu set.\n",
+                           op->id, bad);
+          exit(1);
+        }
+        mm_payload_fill(xalloc_return, op->size, op->id);
+        ptrs[op->id] = xalloc_return;
+        sizes[op->id] = op->size;
         break;
       default:
-      io_msafe_eprintf("Driver: Invalid operation %d.\n", op->alloc_type);
+      io_msafe_eprintf("Driver: Invalid operation %d.\n", op->op);
       exit(1);
     }
+    signal_id(op_index[i]);
   }
+  clock_gettime(CLOCK_MONOTONIC, &arg->end);
   return NULL;
 }
 
@@ -105,57 +184,75 @@ void cleanup(void) {
 }
 
 int main (int argc, char **argv) {
-  mm_driver_action *actions;
-  FILE *trace;
-  char trace_read_buf[TRACE_READ_LINELEN];
-  int ops_per_thread[_MM_INITIAL_NUM_THREADS] = {0};
-  int num_allocs, num_actions;
+  mm_trace trace;
+  size_t num_allocs, nthreads;
 
   atexit(cleanup);
-  
+
   if (argc < 2) {
-    io_msafe_eprintf("Usage: ./driver <trace>\n");
+    io_msafe_eprintf("Usage: ./mtt-driver <trace>\n");
     exit(0);
   }
-  trace = fopen(argv[1], "r");
-  io_msafe_assert(trace != NULL);
-
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace);
-  io_msafe_assert(sscanf(trace_read_buf, "%d", &num_allocs) == 1);
-
-  fgets(trace_read_buf, TRACE_READ_LINELEN + 1, trace);
-  io_msafe_assert(sscanf(trace_read_buf, "%d", &num_actions) == 1);
+  if (mm_trace_open(argv[1], &trace) < 0) {
+    io_msafe_eprintf("driver: cannot load trace %s (%s).\n", argv[1],
+                     strerror(errno));
+    exit(1);
+  }
+  ops = trace.ops;
+  num_allocs = trace.header->num_ids;
+  nthreads = trace.header->num_threads;
+  if (nthreads > _MM_INITIAL_NUM_THREADS) {
+    io_msafe_eprintf("driver: trace uses %lu threads, max is %d.\n",
+                     nthreads, _MM_INITIAL_NUM_THREADS);
+    exit(1);
+  }
 
-  actions = malloc(num_actions * sizeof(mm_driver_action));
-  io_msafe_assert(actions != NULL);
+  ptrs = driver_alloc(num_allocs * sizeof(void *));
+  sizes = driver_alloc(num_allocs * sizeof(size_t));
+  ready = driver_alloc(num_allocs * sizeof(uint32_t));
+  wait_seq = driver_alloc(trace.header->num_ops * sizeof(uint32_t));
 
-  ptrs = malloc(num_allocs * sizeof(void *));
-  io_msafe_assert(ptrs != NULL);
+  runtrace_arg args[nthreads];
+  pthread_t tids[nthreads];
+  split_trace(trace.header, args);
 
-  size_t maxtid = parse_trace(trace_read_buf, trace, actions, ops_per_thread);
-  fclose(trace);
-  mm_driver_action **thread_actions[maxtid + 1]; // list of each thread's actions
-  int count[maxtid + 1];
-  // pthread_t tids[maxtid + 1];
-  memset(count, 0, (maxtid + 1) * sizeof(int));
-  for (int i = 0; i <= maxtid; i++) {
-    thread_actions[i] = malloc(ops_per_thread[i] * sizeof(void *));
+  io_msafe_assert(pthread_barrier_init(&start_barrier, NULL, nthreads + 1) == 0);
+  for (size_t i = 0; i < nthreads; i++) {
+    args[i].latency = driver_alloc(sizeof(mm_latency_stats));
+    io_msafe_assert(pthread_create(&tids[i], NULL, runtrace, &args[i]) == 0);
   }
-  for (int i = 0; i < num_actions; i++) {
-    int thread = actions[i].tid;
-    int index = count[thread]++;
-    thread_actions[thread][index] = actions + i;
+  pthread_barrier_wait(&start_barrier);
+  for (size_t i = 0; i < nthreads; i++) {
+    pthread_join(tids[i], NULL);
   }
-  for (int i = 0; i <= maxtid; i++) {
-    runtrace_arg *arg = malloc(sizeof(runtrace_arg));
-    arg->act = thread_actions[i];
-    arg->nops = ops_per_thread[i];
-    runtrace((void *)arg);
-    // pthread_create(&tids[i], NULL, runtrace, (void *)arg);
+  pthread_barrier_destroy(&start_barrier);
+
+  /* Replay runs from the first thread's start to the last thread's end;
+     main may not be rescheduled until after the workers have begun. */
+  struct timespec t_start = args[0].start, t_end = args[0].end;
+  for (size_t i = 1; i < nthreads; i++) {
+    if (args[i].start.tv_sec < t_start.tv_sec
+        || (args[i].start.tv_sec == t_start.tv_sec
+            && args[i].start.tv_nsec < t_start.tv_nsec))
+      t_start = args[i].start;
+    if (args[i].end.tv_sec > t_end.tv_sec
+        || (args[i].end.tv_sec == t_end.tv_sec
+            && args[i].end.tv_nsec > t_end.tv_nsec))
+      t_end = args[i].end;
+  }
+
+  mm_latency_stats *latency = driver_alloc(sizeof(mm_latency_stats));
+  for (size_t i = 0; i < nthreads; i++) {
+    mm_latency_merge(latency, args[i].latency);
   }
-  // for (int i = 0; i < maxtid; i++) {
-  //   pthread_join(tids[i], NULL);
-  // }
+
+  double secs = (t_end.tv_sec - t_start.tv_sec)
+              + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+  io_msafe_eprintf("Replayed %lu ops on %lu threads in %lu us (%lu ops/s).\n",
+                   trace.header->num_ops, nthreads, (size_t)(secs * 1e6),
+                   secs > 0 ? (size_t)(trace.header->num_ops / secs) : 0);
+  mm_latency_report(latency);
+  mm_trace_close(&trace);
 
   return 0;
-}
\ No newline at end of file
+}
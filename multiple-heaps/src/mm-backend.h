@@ -40,6 +40,9 @@ struct thread_heap_info {
   bool thread_init_done;         /* Whether heap is ready for use */
 };
 
+/* The calling thread's arena, which the thread_* macros above act on */
+extern __thread struct thread_heap_info *thread_arena_context;
+
 struct thread_heap_info *init_single_heap(pid_t tid);
 
 /**
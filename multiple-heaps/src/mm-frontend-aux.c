@@ -18,7 +18,6 @@
 // extern __thread block_t *seglists[];
 
 /** @brief thread ID of the calling thread */
-extern __thread struct thread_heap_info * thread_arena_context;
 // extern __thread pid_t _mm_caller_tid_internal;
 
 /**
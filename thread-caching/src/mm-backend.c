@@ -126,6 +126,10 @@ void *extend_bmp(intptr_t incr) {
     return old_brk;
 }
 
+void *mem_heap_lo(void) {
+    return (void *)heap;
+}
+
 // TODO: change this function
 void *mem_heap_hi(void) {
     return (void *)(mem_brk - 1);
@@ -36,6 +36,8 @@ void reset_bmp_ptr(void);
 */
 size_t current_arena_usage(void);
 
+void *mem_heap_lo(void);
+
 void *mem_heap_hi(void);
 
 #endif /* mm-backend.h */
\ No newline at end of file
@@ -1,59 +1,141 @@
 #ifndef _MM_CACHE_DEFNS_H
 #define _MM_CACHE_DEFNS_H
 
-#define _MMF_OBJECTS_PER_SB (255) /* strictly less than UINT8_MAX */
-#define _MMF_MAX_SB_PER_CLASS (255) /* strictly less than UINT8_MAX */
-#define _MMF_NUM_SIZE_CLASSES (12) /* strictly less than UINT8_MAX */
+#define _MMF_NUM_SIZE_CLASSES (56) /* strictly less than UINT8_MAX */
 #define _MMF_SMALL_THRESHOLD (8192) /* multiple of _MM_PAGESIZE */
+#define _MMF_CLASS_STEPS (8) /* classes per doubling above 128 bytes */
+#define _MMF_CLASS_KEY_SPLIT (1024) /* 16-byte keys up to here, 128 above */
+/* shifts the 128-byte keys to start right after the 16-byte ones */
+#define _MMF_CLASS_KEY_BIAS \
+  ((_MMF_CLASS_KEY_SPLIT / 16 - _MMF_CLASS_KEY_SPLIT / 128) << 7)
+#define _MMF_CLASS_KEYS \
+  ((_MMF_SMALL_THRESHOLD + 127 + _MMF_CLASS_KEY_BIAS) / 128 + 1)
+#define _MMF_TCACHE_SLOTS (64) /* most pointers cached per size class */
+#define _MMF_TCACHE_BYTES (32768) /* cap on bytes cached per size class */
+#define _MMF_EMPTY_SB_KEEP (1) /* empty superblocks a class holds on to */
+#define _MMF_TRANSFER_BYTES (131072) /* cap on bytes the transfer cache holds per class */
+#define _MMF_DESC_CHUNK_BYTES (16384) /* descriptors are mmapped this many at once */
+#define _MMF_SPAN_MIN_BYTES (8192) /* bytes in a class' first superblock, at least */
+#define _MMF_SPAN_MAX_BYTES (262144) /* superblocks stop doubling here */
+#define _MMF_LARGE_SC_INDEX (UINT8_MAX - 1) /* sc_index of a large span */
+#define _MMF_LARGE_CACHE_BUCKETS (9) /* free spans under 2^9 pages are cached */
+#define _MMF_LARGE_CACHE_BYTES (4194304) /* cap on bytes of cached large spans */
+/* With -D_MMF_ALIGNED_SB every superblock is one aligned chunk, found by
+   shifting the pointer into a table instead of through the pagemap. */
+#define _MMF_SB_CHUNK_SHIFT (16) /* 64 KiB chunks */
+#define _MMF_SB_CHUNK_BYTES (1UL << _MMF_SB_CHUNK_SHIFT)
 
 #include "mm-comm.h"
 
 enum _mmf_alloc_type {_MMF_ALLOC, _MMF_FREE};
 
 /**
- * Node in a circular unrolled doubly-linked list.
- * Each superblock can hold up to 128 objects of
- * a given size class. The size of the payload block
- * is (128 * size_class).
+ * Objects freed by threads other than the owner, as one 64-bit word
+ * updated only by compare-and-swap (Michael, "Scalable Lock-Free Dynamic
+ * Memory Allocation"). Remote threads push one object at a time; the
+ * owner takes the whole list once its local list is empty. Every update
+ * bumps tag, so a stale snapshot never compares equal even if the same
+ * head and count come back.
+*/
+typedef union {
+  uint64_t raw;
+  struct {
+    uint16_t head;    /* Index of the most recently pushed object */
+    uint16_t count;   /* Objects on the list, 0 if empty */
+    uint32_t tag;     /* Version, incremented by every update */
+  };
+} sb_anchor;
+
+/**
+ * Node in a circular doubly-linked list.
+ * A superblock holds num_objects objects of one size class, in
+ * num_pages pages. Free objects are linked by index through their
+ * first two bytes; objects never handed out are not on any list, and
+ * are carved in order once the local list is empty.
+ *
+ * A large allocation is a span of num_pages pages with a descriptor of
+ * its own: sc_index is _MMF_LARGE_SC_INDEX, owner is NULL, and the
+ * large-span lock guards the fields the owner would.
 */
 struct superblock_descriptor {
-  void      *payload;
-  struct {  /* 64 bits for atomic compare-and-swap */
+  void      *payload;        /* First page, the start of a midend span */
+  struct thread_metadata_region *owner; /* Thread whose cache holds it */
+  struct {  /* only the owner reads or writes these */
+  struct superblock_descriptor *sb_prev; /* Previous in its list */
+  struct superblock_descriptor *sb_next; /* Next in the active ring, the
+                                            full list or the free stack */
+  uint32_t   num_pages;      /* Pages in the payload */
   uint16_t  size_class;     /* Size of blocks the superblock contains */
-  uint16_t   sb_prev_index;  /* Index of previous active superblock */
-  uint16_t   sb_next_index;  /* Index of next active superblock */
-  uint16_t   num_available;  /* Number of free objects in superblock */
+  uint16_t   num_available;  /* Free objects: local list plus uncarved */
   uint16_t   freelist_head;  /* Head index of inner free list */
-  // uint8_t   unused[2];      /* Padding; could be used later */
+  uint16_t   num_objects;    /* Objects the superblock holds in total */
+  uint16_t   num_carved;     /* Objects handed out at least once */
+  uint8_t    sc_index;       /* Index of the size class */
+  // uint8_t   unused[1];      /* Padding; could be used later */
   };
-  uint16_t   obj_list[_MMF_OBJECTS_PER_SB];  /* Free list */
-}; // 144 bytes
-
-typedef 
-  struct superblock_descriptor 
-  sb_desc_region[_MMF_MAX_SB_PER_CLASS];
+  /* Objects freed by other threads. An object is on at most one of the
+     two lists, so the owner and remote threads never write the same link. */
+  sb_anchor  remote;
+} __attribute__ ((aligned (64))); // one cache line
 
 /**
  * A header that contains information about the 
  * cached data for a specific size class.
  * 
- * sb_start: the start of the array containing all
- * superblock descriptors for the size class.
- * 
- * sb_active: The index of the active superblock. May be null.
+ * sb_active: a superblock in the class' circular list of superblocks
+ * with free objects on their local list. NULL while there are none.
+ *
+ * sb_full: superblocks whose local list is empty. They are kept off the
+ * ring so malloc never walks them; a local free moves one back, and
+ * remote frees set remote_hint so the owner knows a scan may pay off.
 */
 typedef struct {
-  struct superblock_descriptor *sb_start; /* Start of the superblock list */
+  struct superblock_descriptor *sb_active; /* Active superblock, or NULL */
+  struct superblock_descriptor *sb_full;   /* Head of the full list */
+  uint64_t  remote_hint;                   /* Nonzero once a remote free may
+                                              have landed in a full one */
   uint32_t size_class;                    /* Size class of the superblock */
-  uint16_t  sb_active;                     /* Index of the active superblock */
-  uint16_t  active_sb_count;               /* Number of active superblocks */
-  uint16_t  sb_inactive_head;              /* Head of the inactive list */
-  uint16_t  sb_inactive_list[_MMF_MAX_SB_PER_CLASS];
-} size_class_header; // 16 bytes
+  uint32_t  active_sb_count;               /* Superblocks on ring and list */
+  uint32_t  empty_sb_count;                /* Active ones with no live objects */
+  uint32_t  span_pages;                    /* Size of the next superblock */
+} size_class_header; // 48 bytes
 
+/**
+ * Recently freed objects of one size class, owned by this thread.
+ * malloc and free hit this stack first with plain loads and stores;
+ * it is refilled from and flushed to the superblocks in batches.
+*/
+typedef struct {
+  uint16_t count;                    /* Pointers now in slots */
+  uint16_t limit;                    /* Capacity for this size class */
+  uint16_t batch;                    /* Objects moved per refill or flush */
+  void *slots[_MMF_TCACHE_SLOTS];    /* Stack, top at slots[count - 1] */
+} thread_cache_bin;
+
+/**
+ * Per-thread allocator state. When its thread exits, the region is
+ * pushed on a global pool of orphans; the next thread to initialize
+ * adopts it, and with it every superblock it still owns. Until then, a
+ * running thread out of superblocks of some class takes that class'
+ * superblocks from the pool before it asks the midend for more.
+ *
+ * Descriptors are not stored inline: they are mmapped in chunks of
+ * _MMF_DESC_CHUNK_BYTES as the thread's superblock count grows, and a
+ * released superblock's descriptor goes on free_descriptors for reuse by
+ * any size class. Descriptors move with their superblocks when another
+ * thread takes them over, so a chunk may end up serving several regions;
+ * chunks are never unmapped.
+*/
 struct thread_metadata_region {
+  struct thread_metadata_region *next_orphan; /* Link in the orphan pool */
+  struct superblock_descriptor *free_descriptors; /* Linked by sb_next */
+  thread_cache_bin tcache[_MMF_NUM_SIZE_CLASSES];
   size_class_header headers[_MMF_NUM_SIZE_CLASSES];
-  sb_desc_region descriptors[_MMF_NUM_SIZE_CLASSES];
-}; // around 55kb, more if descriptor count = 64
+};
+
+/* About 31 KB: tcache slots take most of it. Each thread maps one, so
+   keep it within eight pages when growing the classes or the bins. */
+_Static_assert(sizeof(struct thread_metadata_region) <= 8 * _MM_PAGESIZE,
+               "thread_metadata_region outgrew its eight pages");
 
 #endif // _MM_CACHE_DEFNS_H
\ No newline at end of file
@@ -4,35 +4,37 @@
 
 #include "mm-frontend-aux.h"
 
-extern size_t bigcount;
-extern size_t bigcount_free;
-/* up to 2 pages is "small" */
-static const uint16_t _mmf_small_size_classes[] = {
-  16, 32, 48, 64, 72, 128, 256, 512,
-  1024, 2048, 4096, 8192
-};
+/* up to 2 pages is "small"; filled in by _mmf_init_size_classes() */
+static uint16_t _mmf_small_size_classes[_MMF_NUM_SIZE_CLASSES];
+/* size class index by _mmf_class_key(size) */
+static uint8_t _mmf_class_index[_MMF_CLASS_KEYS];
+static pthread_once_t _mmf_size_classes_once = PTHREAD_ONCE_INIT;
 
 static size_t _mmf_tid_hash_counter = 0;
-__thread struct thread_metadata_region * _thread_metadata = NULL;
+
+/* Regions of exited threads, waiting for a new thread to adopt them */
+static pthread_mutex_t _mmf_orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_metadata_region *_mmf_orphans = NULL;
+/* initial-exec: a plain %fs-relative load instead of a __tls_get_addr call */
+__thread struct thread_metadata_region * _thread_metadata
+  __attribute__ ((tls_model("initial-exec"))) = NULL;
 
 
 /* Get a pointer to the size class' active superblock. */
 inline struct superblock_descriptor *get_active_sb(size_class_header *h) {
-  uint16_t idx = h->sb_active;
-  if (idx > _MMF_MAX_SB_PER_CLASS) { // no active block yet
-    return NULL;
-  }
-  return &h->sb_start[h->sb_active];
+  return h->sb_active; // NULL if no active block yet
 }
 
 inline struct superblock_descriptor *
 get_prev_sb(size_class_header *h,struct superblock_descriptor *sb) {
-  return &h->sb_start[sb->sb_prev_index];
+  (void)h;
+  return sb->sb_prev;
 }
 
 inline struct superblock_descriptor *get_next_sb(size_class_header *h,
                                             struct superblock_descriptor *sb) {
-  return &h->sb_start[sb->sb_next_index];
+  (void)h;
+  return sb->sb_next;
 }
 
 bool _mmf_cas64(uint64_t *dest, uint64_t swapval, uint64_t cmpval) {
@@ -68,52 +70,84 @@ bool _mmf_cas8(uint8_t *dest, uint8_t swapval, uint8_t cmpval) {
   );
 }
 
+/**
+ * @brief Key into _mmf_class_index: 16-byte granularity up to
+ * _MMF_CLASS_KEY_SPLIT, 128-byte above it, where class steps are at
+ * least that wide. The second range starts right after the first.
+*/
+static inline size_t _mmf_class_key(size_t size) {
+  if (size <= _MMF_CLASS_KEY_SPLIT) {
+    return (size + 15) >> 4;
+  }
+  return (size + 127 + _MMF_CLASS_KEY_BIAS) >> 7;
+}
+
+/**
+ * @brief Generate the size classes and their lookup table.
+ * Classes go up in 16-byte steps to 128 bytes, then _MMF_CLASS_STEPS
+ * evenly spaced classes per doubling, so a request above 128 bytes
+ * wastes less than 1/8 of its block.
+*/
+static void _mmf_init_size_classes(void) {
+  size_t size = 0, step = 16;
+  int i, sc = 0;
+
+  for (i = 0; i < _MMF_NUM_SIZE_CLASSES; i++) {
+    if (size >= 128 && (size & (size - 1)) == 0) {
+      step = size / _MMF_CLASS_STEPS;
+    }
+    size += step;
+    _mmf_small_size_classes[i] = size;
+  }
+  io_msafe_assert(size == _MMF_SMALL_THRESHOLD);
+
+  for (size = 0; size <= _MMF_SMALL_THRESHOLD; size++) {
+    if (size > _mmf_small_size_classes[sc]) {
+      sc++;
+    }
+    _mmf_class_index[_mmf_class_key(size)] = sc;
+  }
+}
+
 // TODO: unit test
 size_t round_request_size(size_t reqsize) {
-  // edge cases
-  if (reqsize > 32 && reqsize <= 48) return 48;
-  if (reqsize > 64 && reqsize <= 72) return 72;
-  reqsize--;
-  for (int i = 0; i < 5; i++)
-    reqsize |= (reqsize >> (1 << i));
-  return max(++reqsize, 16);
+  short sc_index = sc_index_from_size(reqsize);
+  if (sc_index >= 0) {
+    return _mmf_small_size_classes[sc_index];
+  }
+  return round_up(reqsize, _MM_PAGESIZE); /* a large span */
 }
 
-short sc_index_from_size(size_t normsize) {
-  if (normsize > _MMF_SMALL_THRESHOLD) {
-    return -1;
+/**
+ * @brief Pages in a class' first superblock: enough for min_objects
+ * objects and _MMF_SPAN_MIN_BYTES, plus however many more it takes for
+ * the tail past the last object to be at most 1/8 of the span.
+ * Doubling keeps that bound.
+*/
+static uint32_t initial_span_pages(size_t size, size_t min_objects) {
+  size_t bytes = max(size * min_objects, _MMF_SPAN_MIN_BYTES);
+  size_t pages = round_up(bytes, _MM_PAGESIZE) / _MM_PAGESIZE;
+
+  while ((pages * _MM_PAGESIZE) % size > pages * _MM_PAGESIZE / 8) {
+    pages++;
   }
-  switch (normsize) {
-    case 16:
-      return 0;
-    case 32:
-      return 1;
-    case 48:
-      return 2;
-    case 64:
-      return 3;
-    case 72:
-      return 4;
-    case 128:
-      return 5;
-    case 256:
-      return 6;
-    case 512:
-      return 7;
-    case 1024:
-      return 8;
-    case 2048:
-      return 9;
-    case 4096:
-      return 10;
-    case 8192:
-      return 11;
-    default:
-      io_msafe_eprintf(
-        "Error: input size %lu not normalized.\n",
-        normsize);
-      return 0;
+  return pages;
+}
+
+/**
+ * @brief Size class for a request of size bytes, or -1 if it is
+ * larger than _MMF_SMALL_THRESHOLD. Valid once a thread has initialized.
+*/
+short sc_index_from_size(size_t size) {
+  if (size > _MMF_SMALL_THRESHOLD) {
+    return -1;
   }
+  return _mmf_class_index[_mmf_class_key(size)];
+}
+
+/* Object size of a size class */
+size_t size_from_sc_index(short sc_index) {
+  return _mmf_small_size_classes[sc_index];
 }
 
 /**
@@ -145,6 +179,22 @@ pid_t _mmf_hash_tid(pid_t sys_tid) {
 */
 pid_t _mmf_thread_init_metadata(void) {
 
+  pthread_once(&_mmf_size_classes_once, _mmf_init_size_classes);
+
+  /* Adopt an exited thread's region, superblocks and all, if there is one.
+     Descriptors name the region as owner, so nothing else changes. */
+  pthread_mutex_lock(&_mmf_orphan_lock);
+  struct thread_metadata_region *orphan = _mmf_orphans;
+  if (orphan) {
+    _mmf_orphans = orphan->next_orphan;
+  }
+  pthread_mutex_unlock(&_mmf_orphan_lock);
+  if (orphan) {
+    orphan->next_orphan = NULL;
+    _thread_metadata = orphan;
+    return 0;
+  }
+
   size_t metadata_chunk_size = round_up(
     sizeof(struct thread_metadata_region), _MM_PAGESIZE);
 
@@ -167,107 +217,289 @@ pid_t _mmf_thread_init_metadata(void) {
   }
   /* Set pointers for all headers;
      head of descriptor list should be null initially. */
+  region_start->free_descriptors = NULL; // first chunk mapped on demand
   for (int i = 0; i < _MMF_NUM_SIZE_CLASSES; i++) {
-    sb_desc_region *sc_descriptors = &region_start->descriptors[i];
-    struct superblock_descriptor *desc = sc_descriptors[0];
     size_class_header *header = &region_start->headers[i];
     uint16_t size_limit = _mmf_small_size_classes[i];
-    header->sb_start = desc;
     header->active_sb_count = 0;
-    header->sb_active = UINT16_MAX;
-    header->sb_inactive_head = 0;
-    for (uint16_t j = 0; j < _MMF_MAX_SB_PER_CLASS; j++) {
-      header->sb_inactive_list[j] = j + 1;
-      header->sb_start[j].size_class = size_limit;
-    }
+    header->empty_sb_count = 0;
+    header->sb_active = NULL;
+    header->sb_full = NULL;
+    header->remote_hint = 0;
     header->size_class = size_limit;
-    // desc->size_class = size_limit;
+
+    thread_cache_bin *bin = &region_start->tcache[i];
+    bin->count = 0;
+    bin->limit = _MMF_TCACHE_BYTES / size_limit;
+    if (bin->limit > _MMF_TCACHE_SLOTS) bin->limit = _MMF_TCACHE_SLOTS;
+    if (bin->limit < 4) bin->limit = 4;
+    bin->batch = bin->limit / 2;
+    /* a full bin's worth fits in one superblock */
+    header->span_pages = initial_span_pages(size_limit, bin->limit);
   }
   _thread_metadata = region_start;
   return 0;
 }
 
+/**
+ * @brief Link sb into the class' ring, after the active superblock.
+*/
+void ring_insert(size_class_header *header, struct superblock_descriptor *sb) {
+  struct superblock_descriptor *cur_active = get_active_sb(header);
+
+  if (NULL == cur_active) { /* empty ring */
+    header->sb_active = sb;
+    sb->sb_prev = sb; // self
+    sb->sb_next = sb;
+    return;
+  }
+  struct superblock_descriptor *nxt_active = get_next_sb(header, cur_active);
+  sb->sb_prev = cur_active;
+  sb->sb_next = nxt_active;
+  nxt_active->sb_prev = sb;
+  cur_active->sb_next = sb;
+}
+
+/**
+ * @brief Unlink sb from the class' ring, moving sb_active past it.
+*/
+void ring_unlink(size_class_header *header, struct superblock_descriptor *sb) {
+  struct superblock_descriptor *prev = get_prev_sb(header, sb);
+  struct superblock_descriptor *next = get_next_sb(header, sb);
+
+  if (next == sb) { /* last one */
+    header->sb_active = NULL;
+    return;
+  }
+  prev->sb_next = next;
+  next->sb_prev = prev;
+  if (header->sb_active == sb) {
+    header->sb_active = next;
+  }
+}
+
+/**
+ * @brief Push sb on the class' full list (NULL-terminated, doubly linked).
+*/
+void full_push(size_class_header *header, struct superblock_descriptor *sb) {
+  sb->sb_prev = NULL;
+  sb->sb_next = header->sb_full;
+  if (header->sb_full) {
+    header->sb_full->sb_prev = sb;
+  }
+  header->sb_full = sb;
+}
+
+void full_unlink(size_class_header *header, struct superblock_descriptor *sb) {
+  if (sb->sb_prev) {
+    sb->sb_prev->sb_next = sb->sb_next;
+  } else {
+    header->sb_full = sb->sb_next;
+  }
+  if (sb->sb_next) {
+    sb->sb_next->sb_prev = sb->sb_prev;
+  }
+}
+
+/**
+ * @brief Take a descriptor off a free stack linked by sb_next, mapping a
+ * new chunk of them when it is empty. Exits if the kernel refuses.
+*/
+struct superblock_descriptor *
+alloc_descriptor(struct superblock_descriptor **free_stack) {
+  struct superblock_descriptor *sb = *free_stack;
+
+  if (sb == NULL) {
+    size_t n = _MMF_DESC_CHUNK_BYTES / sizeof(struct superblock_descriptor);
+    struct superblock_descriptor *chunk = mmap
+      (NULL,
+      _MMF_DESC_CHUNK_BYTES,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+    if (chunk == MAP_FAILED) {
+      io_msafe_eprintf(
+        "FAILURE. mmap couldn't allocate space for %lu superblock "
+        "descriptors (%s)\n",
+        n, strerror(errno));
+      exit(1);
+    }
+    for (size_t i = 0; i < n - 1; i++) {
+      chunk[i].sb_next = &chunk[i + 1];
+    }
+    chunk[n - 1].sb_next = NULL;
+    sb = chunk;
+  }
+  *free_stack = sb->sb_next;
+  return sb;
+}
+
 void add_new_superblock(size_class_header *header, void *pages,
                         size_t obj_count, size_t request_pages) {
   struct superblock_descriptor *sb;
-  uint16_t sb_reclaim_index;
 
-  io_msafe_assert(obj_count <= _MMF_OBJECTS_PER_SB);
+  io_msafe_assert(obj_count <= UINT16_MAX);
   /* Find a new superblock to use. */
-  sb_reclaim_index = header->sb_inactive_head;
-  io_msafe_assert(sb_reclaim_index < _MMF_MAX_SB_PER_CLASS);
-  io_msafe_assert(header->active_sb_count < _MMF_MAX_SB_PER_CLASS);
-  sb = &header->sb_start[sb_reclaim_index];
+  sb = alloc_descriptor(&_thread_metadata->free_descriptors);
 
-  /* Write new internal free stack. */
+  /* Objects are carved lazily, so the pages aren't touched here. */
   sb->freelist_head = 0;
-  for (int i = 0; i < obj_count - 1; i++) {
-    sb->obj_list[i] = i + 1; /* don't write to last index */
-  }
+  sb->num_carved = 0;
   sb->payload = pages;
+  sb->owner = _thread_metadata;
+  sb->size_class = header->size_class;
+  sb->sc_index = header - _thread_metadata->headers;
+  sb->num_objects = obj_count;
+  sb->num_pages = request_pages;
   sb->num_available = obj_count;
+  sb->remote.raw = 0;
 
   /* Add initialized superblock to list (after active). */
-  if (header->active_sb_count == 0) { /* no active superblocks */
-    header->sb_active = sb_reclaim_index;
-    sb->sb_prev_index = sb_reclaim_index; // self
-    sb->sb_next_index = sb_reclaim_index;
-  } else { /* at least 1 active superblock */
-    struct superblock_descriptor *cur_active = get_active_sb(header);
-    if (NULL == cur_active) { // no active header yet
-      io_msafe_eprintf(
-        "Error: header has %u active blocks but cur_active index is %u.\n",
-        header->active_sb_count, header->sb_active);
-      header->sb_active = sb_reclaim_index;
-      header->sb_start[sb_reclaim_index].sb_next_index = sb_reclaim_index;
-      header->sb_start[sb_reclaim_index].sb_prev_index = sb_reclaim_index;
+  ring_insert(header, sb);
+  header->active_sb_count++;
+  header->empty_sb_count++;
+
+  /* Mark owner of new pages. */
+#ifdef _MMF_ALIGNED_SB
+  pagemap_set_chunk(pages, sb);
+#else
+  pagemap_set_span(pages, request_pages, sb);
+#endif
+}
+
+/**
+ * @brief Give a superblock with no live objects back to the midend.
+ * Unlinks it from the active ring, clears its pagemap entries so reused
+ * memory doesn't resolve to it, and pushes its descriptor on the
+ * region's free stack for the next augment_size_class().
+*/
+void release_superblock(size_class_header *header,
+                        struct superblock_descriptor *sb) {
+  io_msafe_assert(sb->num_available == sb->num_objects);
+  io_msafe_assert(header->active_sb_count > 1);
+  ring_unlink(header, sb);
+  header->active_sb_count--;
+
+#ifdef _MMF_ALIGNED_SB
+  pagemap_set_chunk(sb->payload, NULL);
+#else
+  pagemap_set_span(sb->payload, sb->num_pages, NULL);
+#endif
+  _mm_midend_return(sb->payload);
+
+  sb->sb_next = _thread_metadata->free_descriptors;
+  _thread_metadata->free_descriptors = sb;
+}
+
+/**
+ * @brief Release every empty superblock of a class but one.
+*/
+void release_empty_superblocks(size_class_header *header) {
+  struct superblock_descriptor *sb = get_active_sb(header), *next;
+  uint32_t count = header->active_sb_count;
+
+  /* empty superblocks are all on the ring; stop if it runs out */
+  for (uint32_t i = 0; sb && header->sb_active && i < count; i++, sb = next) {
+    next = get_next_sb(header, sb);
+    if (sb->num_available == sb->num_objects && header->active_sb_count > 1) {
+      header->empty_sb_count--;
+      release_superblock(header, sb);
     }
-    struct superblock_descriptor *nxt_active = get_next_sb(header, cur_active);
-    sb->sb_prev_index = header->sb_active;
-    sb->sb_next_index = cur_active->sb_next_index;
-    nxt_active->sb_prev_index = sb_reclaim_index;
-    cur_active->sb_next_index = sb_reclaim_index;
   }
+}
 
-  /* Remove initialized superblock from empty SB list. */
-  /* Bump head pointer one forward. It's ok if next is a bogus index if last */
-  header->sb_inactive_head = header->sb_inactive_list[header->sb_inactive_head];
-  header->active_sb_count++;
+/**
+ * @brief Hand an exited thread's region to the orphan pool.
+ * Its tcache must be empty.
+*/
+void _mmf_thread_orphan_metadata(struct thread_metadata_region *region) {
+  pthread_mutex_lock(&_mmf_orphan_lock);
+  region->next_orphan = _mmf_orphans;
+  _mmf_orphans = region;
+  pthread_mutex_unlock(&_mmf_orphan_lock);
+}
 
-  /* Mark owner of new pages. */
-  (void)request_pages;
-  for (int i = 0; i < request_pages; i++) {
-    uint8_t *mark_ptr = (uint8_t *)pages + (i * _MM_PAGESIZE);
-    pagemap_reallocate(mark_ptr, sb);
+/**
+ * @brief Take over the superblocks of header's class from the first
+ * orphaned region that has any, so a running thread reuses what exited
+ * threads left behind before it grows the heap. The region stays in the
+ * pool, for the next new thread to adopt.
+ * @return true if any superblocks moved
+*/
+static bool adopt_orphan_superblocks(size_class_header *header) {
+  size_t sc_index = header - _thread_metadata->headers;
+  struct thread_metadata_region *orphan;
+  struct superblock_descriptor *sb;
+  size_class_header *from = NULL;
+
+  if (_mmf_orphans == NULL) {
+    return false; /* unlocked peek; a stale miss costs one new superblock */
+  }
+  pthread_mutex_lock(&_mmf_orphan_lock);
+  for (orphan = _mmf_orphans; orphan; orphan = orphan->next_orphan) {
+    from = &orphan->headers[sc_index];
+    if (from->active_sb_count > 0) {
+      break;
+    }
+  }
+  if (orphan == NULL) {
+    pthread_mutex_unlock(&_mmf_orphan_lock);
+    return false;
+  }
+  while ((sb = get_active_sb(from)) != NULL) {
+    ring_unlink(from, sb);
+    sb->owner = _thread_metadata;
+    ring_insert(header, sb);
+  }
+  while ((sb = from->sb_full) != NULL) {
+    full_unlink(from, sb);
+    sb->owner = _thread_metadata;
+    full_push(header, sb);
   }
+  header->active_sb_count += from->active_sb_count;
+  header->empty_sb_count += from->empty_sb_count;
+  from->active_sb_count = 0;
+  from->empty_sb_count = 0;
+  from->remote_hint = 0;
+  pthread_mutex_unlock(&_mmf_orphan_lock);
+  /* full ones may hold remote frees, and a free racing with the owner
+     change may have hinted the orphan instead */
+  header->remote_hint = 1;
+  return true;
 }
 
 /**
- * @brief Replenish a size class with superblocks from page heap.
+ * @brief Replenish a size class with superblocks: an exited thread's,
+ * if one left any, otherwise new ones from the page heap.
+ * Each call for new ones doubles the class' next superblock, up to
+ * _MMF_SPAN_MAX_BYTES, so hot classes refill from the midend less often.
 */
 bool augment_size_class(size_class_header *header) {
+  if (adopt_orphan_superblocks(header)) {
+    return true;
+  }
   // Request more pages from midend
   void *pages;
   size_t bsize = header->size_class;
-  size_t objs_per_sb = _MMF_OBJECTS_PER_SB;
-  // if (bsize >= 1024) objs_per_sb >>= 2;
-  size_t max_sb_size = bsize * objs_per_sb;
-  size_t request_bytes = round_up(max_sb_size, _MM_PAGESIZE);
-  size_t request_pages = request_bytes / _MM_PAGESIZE;
+#ifdef _MMF_ALIGNED_SB
+  /* Every superblock is one chunk, whatever the class */
+  size_t request_pages = _MMF_SB_CHUNK_BYTES / _MM_PAGESIZE;
+  size_t request_bytes = _MMF_SB_CHUNK_BYTES;
+  size_t objs_per_sb = request_bytes / bsize;
 
-  if (header->active_sb_count == _MMF_MAX_SB_PER_CLASS) {
-    io_msafe_eprintf(
-      "Error: no more superblocks available for size class %lu.\n",
-      bsize);
-    io_msafe_eprintf("4096 count: %lu.\n", bigcount);
-  }
-  // provision for header
-  pages = _mm_midend_request_bytes(request_bytes - 16);
+  pages = _mm_midend_request_aligned(request_pages, _MMF_SB_CHUNK_BYTES);
+#else
+  size_t request_pages = header->span_pages;
+  size_t request_bytes = request_pages * _MM_PAGESIZE;
+  size_t objs_per_sb = request_bytes / bsize;
+
+  pages = _mm_midend_request_pages(request_pages);
+#endif
   if (!pages) {
     io_msafe_eprintf(
       "Error requesting %lu bytes from midend.\n",
       request_bytes);
-    io_msafe_eprintf("16 alloc: %lu. 16 free: %lu.\n", bigcount, bigcount_free);
     exit(1);
   }
   // io_msafe_eprintf_dbg(
@@ -275,5 +507,8 @@ bool augment_size_class(size_class_header *header) {
   //   "%lu objects of size %lu.\n",
     // request_bytes, objs_per_sb, bsize);
   add_new_superblock(header, pages, objs_per_sb, request_pages);
+  if (request_bytes * 2 <= _MMF_SPAN_MAX_BYTES) {
+    header->span_pages = request_pages * 2;
+  }
   return true;
 }
@@ -22,15 +22,35 @@ bool _mmf_cas8(uint8_t *dest, uint8_t swapval, uint8_t cmpval) __attribute__ ((n
 
 size_t round_request_size(size_t reqsize);
 
-short sc_index_from_size(size_t normsize);
+short sc_index_from_size(size_t size);
+
+size_t size_from_sc_index(short sc_index);
 
 pid_t _mmf_hash_tid(pid_t sys_tid) __attribute__ ((unused));
 
 pid_t _mmf_thread_init_metadata(void);
 
+void _mmf_thread_orphan_metadata(struct thread_metadata_region *region);
+
+void ring_insert(size_class_header *header, struct superblock_descriptor *sb);
+
+void ring_unlink(size_class_header *header, struct superblock_descriptor *sb);
+
+void full_push(size_class_header *header, struct superblock_descriptor *sb);
+
+void full_unlink(size_class_header *header, struct superblock_descriptor *sb);
+
+struct superblock_descriptor *
+alloc_descriptor(struct superblock_descriptor **free_stack);
+
 void add_new_superblock(size_class_header *header, void *pages,
                         size_t obj_count, size_t request_pages);
 
+void release_superblock(size_class_header *header,
+                        struct superblock_descriptor *sb);
+
+void release_empty_superblocks(size_class_header *header);
+
 bool augment_size_class(size_class_header *header);
 
 #endif // _MM_FRONTEND_AUX_H
\ No newline at end of file
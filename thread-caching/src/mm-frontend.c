@@ -8,119 +8,282 @@
 #include "mm-frontend.h"
 #include "mm-frontend-aux.h"
 #include "mm-pagemap.h"
+#include "mm-transfer.h"
+#include "mm-large.h"
 
-size_t bigcount = 0;
-size_t bigcount_free = 0;
-extern __thread struct thread_metadata_region * _thread_metadata;
+extern __thread struct thread_metadata_region * _thread_metadata
+  __attribute__ ((tls_model("initial-exec")));
+
+/**
+ * @brief Move the objects other threads freed into sb onto its local list.
+ * Only called by the owner, and only once the local list is empty.
+ * @return true if any objects were collected
+*/
+static bool collect_remote_frees(struct superblock_descriptor *sb) {
+  sb_anchor old, new;
+  do {
+    old.raw = sb->remote.raw;
+    if (old.count == 0) {
+      return false;
+    }
+    new.head = 0;
+    new.count = 0;
+    new.tag = old.tag + 1;
+  } while (!_mmf_cas64(&sb->remote.raw, new.raw, old.raw));
+  sb->freelist_head = old.head;
+  sb->num_available = old.count;
+  if (sb->num_available == sb->num_objects) {
+    _thread_metadata->headers[sb->sc_index].empty_sb_count++;
+  }
+  return true;
+}
+
+/**
+ * @brief Move every full superblock that other threads have freed into
+ * back onto the ring. Only worth a walk once remote_hint is set.
+ * @return true if the ring is no longer empty
+*/
+static bool collect_full_superblocks(size_class_header *header) {
+  uint64_t hint;
+  struct superblock_descriptor *sb, *next;
+
+  /* reset with a locked op, so the walk sees every push that set it */
+  do {
+    hint = header->remote_hint;
+  } while (!_mmf_cas64(&header->remote_hint, 0, hint));
+  for (sb = header->sb_full; sb; sb = next) {
+    next = sb->sb_next;
+    if (collect_remote_frees(sb)) {
+      full_unlink(header, sb);
+      ring_insert(header, sb);
+    }
+  }
+  return get_active_sb(header) != NULL;
+}
+
+/* Link to the next free object, stored in the free object itself. */
+static inline uint16_t *sb_link(struct superblock_descriptor *sb,
+                                uint16_t obj_index) {
+  return (uint16_t *)((uint8_t *)sb->payload +
+                      (size_t)obj_index * sb->size_class);
+}
 
 static void *malloc_active(size_class_header *header) {
-  uint16_t curr_available, curr_index = header->sb_active;
   struct superblock_descriptor *active = get_active_sb(header);
+  uint16_t obj_index;
 
-  typedef uint16_t search_obj_t[header->size_class];
-  
+  /* the ring only holds superblocks with free objects */
   if (!active) {
-    return NULL; // empty list
+    if (!header->remote_hint || !collect_full_superblocks(header)) {
+      return NULL;
+    }
+    active = get_active_sb(header);
   }
 
-  /* reserve a slot */
-  do {
-test_new_superblock:
-    curr_available = active->num_available;
-    // io_msafe_eprintf("avail for class %u = %u.\n", header->size_class, curr_available);
-    if (curr_available == 0) {
-      /* if current superblock full, go to next */
-      curr_index = active->sb_next_index;
-      active = &header->sb_start[curr_index];
-
-      /* traversed the whole list, nothing found */
-      if (curr_index == header->sb_active) {
-        return NULL;
-      } else {
-        goto test_new_superblock;
+  /* only this thread touches the local list: no atomics needed */
+  if (active->num_available == active->num_objects) {
+    header->empty_sb_count--;
+  }
+  if (active->num_available > active->num_objects - active->num_carved) {
+    obj_index = active->freelist_head;
+    active->freelist_head = *sb_link(active, obj_index);
+  } else {
+    obj_index = active->num_carved++;
+  }
+  active->num_available--;
+  if (active->num_available == 0 && !collect_remote_frees(active)) {
+    /* park it until an object comes back */
+    ring_unlink(header, active);
+    full_push(header, active);
+  }
+  return (uint8_t *)active->payload + (size_t)obj_index * header->size_class;
+}
+
+/**
+ * @brief Fill an empty tcache bin with a batch of objects from the
+ * superblocks of its size class. If they are all full, take a batch
+ * another thread gave up before adding a superblock.
+*/
+static void tcache_refill(short sc_index, thread_cache_bin *bin) {
+  size_class_header *header = &_thread_metadata->headers[sc_index];
+
+  while (bin->count < bin->batch) {
+    void *payload = malloc_active(header);
+    if (!payload) {
+      if (bin->count > 0) {
+        return; // partial batch; don't grow the class for the rest
       }
+      if ((bin->count = transfer_pop(sc_index, bin->slots)) > 0) {
+        return;
+      }
+      augment_size_class(header); // exits on failure
+      continue;
     }
-  /* if current avail count is unchanged, decrement and push update */
-  } while (!_mmf_cas16(&active->num_available, curr_available - 1, curr_available));
-  /* slot reserved; use current as active */
-  header->sb_active = curr_index;
+    bin->slots[bin->count++] = payload;
+  }
+}
 
-  /* try to pop block from free list */
-  uint16_t *block_list = active->obj_list;
-  uint16_t cur_head_idx, next_head_idx;
+/**
+ * @brief Return an object to its superblock: the local list if this
+ * thread owns it, the remote list otherwise.
+*/
+static void free_to_superblock(struct superblock_descriptor *desc, void *ptr) {
+  /* make sure pointer within bounds */
+  size_t payload_idx = ((uintptr_t)ptr - (uintptr_t)desc->payload) / desc->size_class;
+  io_msafe_assert(payload_idx < desc->num_objects);
+  uint16_t obj_index = (uint16_t)payload_idx;
+
+  if (desc->owner == _thread_metadata) {
+    size_class_header *header = &_thread_metadata->headers[desc->sc_index];
+    if (desc->num_available == 0) { /* back from the full list */
+      full_unlink(header, desc);
+      ring_insert(header, desc);
+    }
+    /* push onto the owner's local list */
+    *sb_link(desc, obj_index) = desc->freelist_head;
+    desc->freelist_head = obj_index;
+    desc->num_available++;
+    if (desc->num_available == desc->num_objects) {
+      /* keep a few empty superblocks so a class doesn't thrash */
+      if (++header->empty_sb_count > _MMF_EMPTY_SB_KEEP) {
+        header->empty_sb_count--;
+        release_superblock(header, desc);
+      }
+    }
+    return;
+  }
+
+  /* push onto the remote list with a single compare-and-swap */
+  sb_anchor old, new;
   do {
-    cur_head_idx = active->freelist_head;
-    next_head_idx = block_list[cur_head_idx];
-    /* if payload head is still cur_head_idx, swap it with next_head_idx */
-  } while (!_mmf_cas16(&active->freelist_head, next_head_idx, cur_head_idx));
-  return &((search_obj_t *)active->payload)[cur_head_idx];
+    old.raw = desc->remote.raw;
+    *sb_link(desc, obj_index) = old.head;
+    new.head = obj_index;
+    new.count = old.count + 1;
+    new.tag = old.tag + 1;
+  } while (!_mmf_cas64(&desc->remote.raw, new.raw, old.raw));
+  if (old.count == 0) { /* the owner may have parked it as full */
+    desc->owner->headers[desc->sc_index].remote_hint = 1;
+  }
 }
 
-void *malloc(size_t size) {
+/**
+ * @brief Pass the oldest batch of a full tcache bin to the transfer
+ * cache, or back to its superblocks if the transfer cache is full.
+*/
+static void tcache_flush(short sc_index, thread_cache_bin *bin) {
+  if (!transfer_push(sc_index, _thread_metadata->headers[sc_index].size_class,
+                     bin->slots, bin->batch)) {
+    for (uint16_t i = 0; i < bin->batch; i++) {
+      free_to_superblock(pagemap_lookup_cached(bin->slots[i]), bin->slots[i]);
+    }
+  }
+  bin->count -= bin->batch;
+  memmove(bin->slots, bin->slots + bin->batch, bin->count * sizeof(void *));
+}
+
+/* Set once this thread's region is orphaned, for frees that come later */
+static __thread bool _mmf_thread_exiting
+  __attribute__ ((tls_model("initial-exec"))) = false;
+static pthread_key_t _mmf_exit_key;
+static pthread_once_t _mmf_exit_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Thread-exit destructor: drain the tcache, give empty superblocks
+ * back to the midend, and orphan the region for the next thread to adopt.
+*/
+static void _mmf_thread_exit(void *region) {
+  (void)region;
+  for (int i = 0; i < _MMF_NUM_SIZE_CLASSES; i++) {
+    thread_cache_bin *bin = &_thread_metadata->tcache[i];
+    while (bin->count > 0) {
+      void *ptr = bin->slots[--bin->count];
+      free_to_superblock(pagemap_lookup(ptr), ptr);
+    }
+    release_empty_superblocks(&_thread_metadata->headers[i]);
+  }
+  pagemap_cache_retire();
+  _mmf_thread_orphan_metadata(_thread_metadata);
+  /* the region may already be someone else's: see free() */
+  _thread_metadata = NULL;
+  _mmf_thread_exiting = true;
+}
+
+static void _mmf_make_exit_key(void) {
+  pthread_key_create(&_mmf_exit_key, _mmf_thread_exit);
+}
+
+/* Set up this thread's metadata on its first malloc or free. */
+static void _mmf_thread_init(void) {
+  if (_mmf_thread_init_metadata() < 0) {
+    perror("malloc");
+    exit(1);
+  }
+  pthread_once(&_mmf_exit_key_once, _mmf_make_exit_key);
+  pthread_setspecific(_mmf_exit_key, _thread_metadata);
+}
+
+/* malloc proper. calloc calls this rather than malloc, because at -O2
+   gcc folds malloc followed by memset into a call to calloc itself. */
+static void *_mmf_malloc(size_t size) {
   size_t objsize;
   short sc_index;
-  size_class_header *req_size_class;
-  void *payload = NULL;
+  thread_cache_bin *bin;
   
   if (size == 0) return NULL;
   // io_msafe_eprintf("malloc (%lu)\n", size);
   /* Initialize thread metadata */
-  if (_thread_metadata == NULL &&
-  _mmf_thread_init_metadata() < 0) {
-    perror("malloc");
-    exit(1);
+  if (_thread_metadata == NULL) {
+    _mmf_thread_init();
   }
 
-  // objsize is a power of 2, and thus a multiple of pagesize
-  // if greater than min threshold.
-  objsize = round_request_size(size);
-  if (objsize == 16) { // TODO: temporary
-    bigcount++;
-  }
-  sc_index = sc_index_from_size(objsize);
+  sc_index = sc_index_from_size(size);
   if (sc_index < 0) {
-    // malloc from page heap
-    return _mm_midend_request_bytes(objsize);
+    // malloc a span from the page heap; objsize is a multiple of pagesize
+    objsize = round_request_size(size);
+    return large_alloc(objsize / _MM_PAGESIZE);
   }
-  req_size_class = &_thread_metadata->headers[sc_index];
-  
-  payload = malloc_active(req_size_class);
-  if (!payload) {
-    augment_size_class(req_size_class);
-    payload = malloc_active(req_size_class);
+  bin = &_thread_metadata->tcache[sc_index];
+  if (bin->count == 0) {
+    tcache_refill(sc_index, bin);
   }
-  return payload;
+  return bin->slots[--bin->count];
+}
+
+void *malloc(size_t size) {
+  return _mmf_malloc(size);
 }
 
 void free(void *ptr) {
   if (ptr == NULL) return; // C standard
-  struct superblock_descriptor *desc = pagemap_lookup(ptr);
-  if (NULL == desc) { /* too large for cache */
+  /* the class byte is all a small free needs, not the descriptor */
+  short sc_index = pagemap_class_cached(ptr);
+  if (sc_index < 0) { /* not from this allocator */
     // io_msafe_eprintf(
     //   "Size class not found for pointer %p.\n", ptr); 
     return;
   }
-  if (desc->size_class == 16) {
-    bigcount_free++;
+  if (sc_index == _MMF_LARGE_SC_INDEX) {
+    large_free(pagemap_lookup_cached(ptr));
+    return;
   }
-  /* make sure pointer within bounds */
-  size_t payload_idx = ((uintptr_t)ptr - (uintptr_t)desc->payload) / desc->size_class;
-  io_msafe_assert(payload_idx <= _MMF_OBJECTS_PER_SB);
-
-  /* push free block onto stack */
-  uint16_t *block_list = desc->obj_list;
-  uint16_t cur_head_idx, new_head_idx = (uint16_t)payload_idx;
-  do {
-    cur_head_idx = desc->freelist_head;
-    block_list[new_head_idx] = cur_head_idx; // new->next = cur_head
-    /* if payload head is still cur_head_idx, swap it with new object */
-  } while (!_mmf_cas16(&desc->freelist_head, new_head_idx, cur_head_idx));
-
-  /* broadcast new availability */
-  uint16_t avail_now;
-  do {
-    avail_now = desc->num_available;
-  } while (!_mmf_cas16(&desc->num_available, avail_now + 1, avail_now));
+  /* objects go through the tcache, whichever thread's superblock they
+     came from; surplus moves on in batches via the transfer cache */
+  if (_thread_metadata == NULL) {
+    if (_mmf_thread_exiting) {
+      /* a later destructor of this thread: rather than adopt a region
+         (likely the one just orphaned) and register the exit key again,
+         push the object on its superblock's remote list */
+      free_to_superblock(pagemap_lookup(ptr), ptr);
+      return;
+    }
+    _mmf_thread_init(); // a consumer that never mallocs
+  }
+  thread_cache_bin *bin = &_thread_metadata->tcache[sc_index];
+  if (bin->count == bin->limit) {
+    tcache_flush(sc_index, bin);
+  }
+  bin->slots[bin->count++] = ptr;
 }
 
 /**
@@ -135,8 +298,7 @@ void free(void *ptr) {
 void *realloc(void *ptr, size_t size) {
     // io_msafe_eprintf("FATAL: REALLOC.\n");
     // exit(1);
-    // size_class_header *header;
-    // size_t copysize;
+    size_t copysize, oldsize;
     void *newptr;
 
     if (size == 0) {
@@ -152,11 +314,40 @@ void *realloc(void *ptr, size_t size) {
       return NULL;
     }
 
-    memcpy(newptr, ptr, size);
+    /* copy no more than the old block holds, when the pagemap knows it */
+    copysize = size;
+    oldsize = malloc_usable_size(ptr);
+    if (oldsize != 0 && oldsize < copysize) {
+        copysize = oldsize;
+    }
+    memcpy(newptr, ptr, copysize);
     free(ptr);
     return newptr;
 }
 
+/**
+ * @brief Return the number of bytes usable in a block: its size class,
+ * or the whole span for a large allocation.
+ *
+ * @param[in] ptr Pointer returned by malloc, calloc or realloc.
+ * @return The usable size, or 0 if ptr is NULL or not from this heap.
+ */
+size_t malloc_usable_size(void *ptr) {
+    short sc_index;
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    sc_index = pagemap_class_cached(ptr);
+    if (sc_index < 0) {
+        return 0;
+    }
+    if (sc_index == _MMF_LARGE_SC_INDEX) {
+        return (size_t)pagemap_lookup_cached(ptr)->num_pages * _MM_PAGESIZE;
+    }
+    return size_from_sc_index(sc_index);
+}
+
 /**
  * @brief Allocate an array of elements onto the heap and initialize all
  * contents to zero.
@@ -177,7 +368,7 @@ void *calloc(size_t nmemb, size_t size) {
         return NULL;
     }
 
-    ptr = malloc(asize);
+    ptr = _mmf_malloc(asize);
     if (ptr == NULL) {
         return NULL;
     }
@@ -10,5 +10,6 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *calloc(size_t nmemb, size_t size);
 extern void *realloc(void *ptr, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif /* _MM_FRONTEND_H */
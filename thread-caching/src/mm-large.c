@@ -0,0 +1,105 @@
+/**
+ * @file mm-large.c
+ * @brief Large spans: allocations too big for any size class.
+ *
+ * Each allocation is a midend span of its own, whose first and last
+ * pages are mapped in the pagemap to a descriptor that records its page
+ * count.
+ * Descriptors come from a global free stack, as a span may be freed by
+ * a thread other than the one that allocated it.
+ *
+ * Freed spans under 2^_MMF_LARGE_CACHE_BUCKETS pages are cached, up to
+ * _MMF_LARGE_CACHE_BYTES in all, on lists bucketed by the log2 of their
+ * page count. A request takes the first span in its bucket that is big
+ * enough, so it wastes less than half the span. Cached spans stay
+ * registered in the pagemap.
+*/
+
+#include "mm-large.h"
+#include "mm-frontend-aux.h"
+#include "mm-pagemap.h"
+
+/* Access is serialized, like the midend every uncached span goes to */
+static pthread_mutex_t _mmf_large_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct superblock_descriptor *_mmf_large_cache[_MMF_LARGE_CACHE_BUCKETS];
+static size_t _mmf_large_cached_bytes = 0;
+static struct superblock_descriptor *_mmf_large_descriptors = NULL;
+
+/* Cache bucket of a span: floor(log2(num_pages)) */
+static inline int large_bucket(size_t num_pages) {
+  int bucket = 0;
+  while (num_pages >>= 1) {
+    bucket++;
+  }
+  return bucket;
+}
+
+static inline void *large_last_page(struct superblock_descriptor *desc) {
+  return (uint8_t *)desc->payload + (desc->num_pages - 1) * _MM_PAGESIZE;
+}
+
+void *large_alloc(size_t num_pages) {
+  int bucket = large_bucket(num_pages);
+  struct superblock_descriptor *desc, **link;
+  void *pages;
+
+  if (num_pages > UINT32_MAX) {
+    return NULL; /* far past what the backend can map anyway */
+  }
+  pthread_mutex_lock(&_mmf_large_lock);
+  if (bucket < _MMF_LARGE_CACHE_BUCKETS) {
+    for (link = &_mmf_large_cache[bucket]; (desc = *link) != NULL;
+         link = &desc->sb_next) {
+      if (desc->num_pages >= num_pages) {
+        *link = desc->sb_next;
+        _mmf_large_cached_bytes -= (size_t)desc->num_pages * _MM_PAGESIZE;
+        pthread_mutex_unlock(&_mmf_large_lock);
+        return desc->payload;
+      }
+    }
+  }
+  desc = alloc_descriptor(&_mmf_large_descriptors);
+  pthread_mutex_unlock(&_mmf_large_lock);
+
+  pages = _mm_midend_request_pages(num_pages);
+  if (!pages) {
+    pthread_mutex_lock(&_mmf_large_lock);
+    desc->sb_next = _mmf_large_descriptors;
+    _mmf_large_descriptors = desc;
+    pthread_mutex_unlock(&_mmf_large_lock);
+    return NULL;
+  }
+  desc->payload = pages;
+  desc->owner = NULL;
+  desc->num_pages = num_pages;
+  desc->size_class = 0;
+  desc->sc_index = _MMF_LARGE_SC_INDEX;
+  pagemap_set_span(desc->payload, 1, desc);
+  pagemap_set_span(large_last_page(desc), 1, desc);
+  return desc->payload;
+}
+
+void large_free(struct superblock_descriptor *desc) {
+  size_t bytes = (size_t)desc->num_pages * _MM_PAGESIZE;
+  int bucket = large_bucket(desc->num_pages);
+
+  pthread_mutex_lock(&_mmf_large_lock);
+  if (bucket < _MMF_LARGE_CACHE_BUCKETS &&
+      _mmf_large_cached_bytes + bytes <= _MMF_LARGE_CACHE_BYTES) {
+    desc->sb_next = _mmf_large_cache[bucket];
+    _mmf_large_cache[bucket] = desc;
+    _mmf_large_cached_bytes += bytes;
+    pthread_mutex_unlock(&_mmf_large_lock);
+    return;
+  }
+  pthread_mutex_unlock(&_mmf_large_lock);
+
+  pagemap_set_span(desc->payload, 1, NULL);
+  pagemap_set_span(large_last_page(desc), 1, NULL);
+  _mm_midend_return(desc->payload);
+
+  pthread_mutex_lock(&_mmf_large_lock);
+  desc->sb_next = _mmf_large_descriptors;
+  _mmf_large_descriptors = desc;
+  pthread_mutex_unlock(&_mmf_large_lock);
+}
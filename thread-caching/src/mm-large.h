@@ -0,0 +1,27 @@
+#ifndef _MM_LARGE_H
+#define _MM_LARGE_H
+
+/**
+ * @file mm-large.h
+ * @brief Allocations above _MMF_SMALL_THRESHOLD, each a page-aligned span
+ * of its own that the pagemap maps to a descriptor, so any thread can
+ * free it. Recently freed spans are cached for reuse.
+*/
+
+#include "mm-comm.h"
+#include "mm-cache-defines.h"
+
+/**
+ * @brief Get a span of at least num_pages pages, from the cache if a
+ * freed one fits, otherwise from the midend.
+ * @return the page-aligned span, NULL if the midend is out of memory
+*/
+void *large_alloc(size_t num_pages);
+
+/**
+ * @brief Free the span desc describes: keep it in the cache if there is
+ * room, otherwise give it back to the midend.
+*/
+void large_free(struct superblock_descriptor *desc);
+
+#endif // _MM_LARGE_H
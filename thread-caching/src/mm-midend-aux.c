@@ -1,24 +1,40 @@
 /**
  * @file mm-midend-aux.c
  * @author Makoto Tomokiyo <mtomokiy@andrew.cmu.edu>
- * @brief Auxiliary functions for allocator middle end.
+ * @brief Auxiliary functions for allocator middle end: span records, the
+ * span map, and the free lists and tree of free spans.
+ *
+ * None of these lock; the caller holds the midend's lock.
 */
 
 #include "mm-midend-aux.h"
 #include "mm-backend.h"
 
 /**
- * Global variables 
+ * Global variables
  */
 
-/** @brief Pointer to first block in the heap */
-block_t *heap_start = NULL;
+/** @brief Address of the first page of the heap, once there is one */
+static uintptr_t heap_base = 0;
 
-/** @brief Pointer to the start of the miniblock list */
-miniblock_t *miniblock_pointer = NULL;
+/** @brief Pages between the heap start and the break, all in spans */
+static size_t heap_pages = 0;
 
-/** @brief Array of explicit lists segregated by size class */
-block_t *seglists[NUM_CLASSES];
+/** @brief Span of the first and last page of every span, by page index.
+ * Only the pages of it that are written become resident. */
+static span_t *span_map[_MM_HEAP_PAGES];
+
+/** @brief Free spans of 1 to _MM_SPAN_LIST_PAGES pages, by page count */
+static span_t *free_lists[_MM_SPAN_LIST_PAGES];
+
+/** @brief Bit i set if free_lists[i] is nonempty */
+static uint64_t free_list_mask[_MM_SPAN_LIST_WORDS];
+
+/** @brief Root of the treap of longer free spans */
+static span_t *large_spans = NULL;
+
+/** @brief Unused span records, linked by next */
+static span_t *free_records = NULL;
 
 /**
  * @brief Returns the maximum of two integers.
@@ -40,401 +56,267 @@ size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
-static block_t *find_prev_free(block_t *block) {
-
-    block_t *prev = (block->ptrs).prev;
-    return prev;
-}
-
-static block_t *find_next_free(block_t *block) {
-
-    block_t *nxt = (block->ptrs).next;
-    return nxt;
-}
-
-static void set_prev_free(block_t *block, block_t *new_prev) {
-    (block->ptrs).prev = new_prev;
+void *span_address(span_t *span) {
+    return (void *)(heap_base + span->first * _MM_PAGESIZE);
 }
 
-static void set_next_free(block_t *block, block_t *new_next) {
-    (block->ptrs).next = new_next;
-}
-
-static void set_prev_alloc(block_t *block, bool alloc) {
-
-    if (alloc) {
-        block->header |= prev_alloc_mask;
-    } else {
-        block->header &= ~prev_alloc_mask;
-    }
-}
+span_t *span_of(void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    size_t page;
+    span_t *span;
 
-word_t pack(size_t size, bool alloc, bool palloc, bool pmini) {
-    word_t word = size;
-    if (alloc) {
-        word |= alloc_mask;
-    }
-    if (palloc) {
-        word |= prev_alloc_mask;
+    if (heap_base == 0 || addr < heap_base ||
+        (addr - heap_base) % _MM_PAGESIZE != 0) {
+        return NULL;
     }
-    if (pmini) {
-        word |= prev_mini_mask;
+    page = (addr - heap_base) / _MM_PAGESIZE;
+    if (page >= heap_pages) {
+        return NULL;
     }
-    return word;
-}
-
-size_t extract_size(word_t word) {
-    return (word & size_mask);
-}
-
-size_t get_size(block_t *block) {
-    return extract_size(block->header);
-}
-
-block_t *payload_to_header(void *bp) {
-    return (block_t *)((char *)bp - offsetof(block_t, payload));
-}
-
-void *header_to_payload(block_t *block) {
-    return (void *)(block->payload);
-}
-
-word_t *header_to_footer(block_t *block) {
-    return (word_t *)(block->payload + get_size(block) - dsize);
-}
-
-
-block_t *footer_to_header(word_t *footer) {
-    size_t size = extract_size(*footer);
-    return (block_t *)((char *)footer + wsize - size);
+    span = span_map[page];
+    return (span && span->first == page) ? span : NULL;
 }
 
-size_t get_payload_size(block_t *block) {
-    size_t asize = get_size(block);
-    return asize - wsize;
+void span_register(span_t *span) {
+    span_map[span->first] = span;
+    span_map[span->first + span->num_pages - 1] = span;
 }
 
-static bool extract_alloc(word_t word) {
-    return (bool)(word & alloc_mask);
-}
-
-bool get_alloc(block_t *block) {
-    return extract_alloc(block->header);
-}
+span_t *span_new(size_t first, size_t num_pages) {
+    span_t *span = free_records;
 
-static bool extract_prev_alloc(word_t word) {
-    return (bool)(word & prev_alloc_mask);
-}
+    if (span == NULL) {
+        size_t n = _MM_SPAN_CHUNK_BYTES / sizeof(span_t);
+        span_t *chunk = mmap(NULL, _MM_SPAN_CHUNK_BYTES,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            io_msafe_eprintf(
+                    "FAILURE. mmap couldn't allocate space for %lu span "
+                    "records (%s)\n",
+                    n, strerror(errno));
+            exit(1);
+        }
+        for (size_t i = 0; i < n - 1; i++) {
+            chunk[i].next = &chunk[i + 1];
+        }
+        chunk[n - 1].next = NULL;
+        span = chunk;
+    }
+    free_records = span->next;
 
-bool get_prev_alloc(block_t *block) {
-    return extract_prev_alloc(block->header);
+    span->first = first;
+    span->num_pages = num_pages;
+    span->prev = span->next = NULL;
+    span->left = span->right = NULL;
+    span->free = false;
+    span_register(span);
+    return span;
 }
 
-static void write_epilogue(block_t *block) {
-    block->header = pack(0, true, false, false);
+/**
+ * @brief Recycle the record of a span that has been merged into another.
+ * Its span map entries now belong to the other span.
+ */
+static void span_delete(span_t *span) {
+    span->next = free_records;
+    free_records = span;
 }
 
-static bool is_miniblock(block_t *block) {
-    return get_size(block) <= 16;
-}
+/*
+ * The large-span tree is a treap ordered by (num_pages, first), so the
+ * leftmost span of at least n pages is the best fit. Priorities are a
+ * hash of the first page, which keeps the tree balanced in expectation
+ * without storing anything.
+ */
 
-static block_t *find_next(block_t *block) {
-    return (block_t *)((char *)block + get_size(block));
+static inline bool span_less(span_t *a, span_t *b) {
+    return a->num_pages < b->num_pages ||
+           (a->num_pages == b->num_pages && a->first < b->first);
 }
 
-bool get_prev_mini(block_t *block) {
-    return (bool)(block->header & prev_mini_mask);
+static inline uint64_t span_priority(span_t *span) {
+    return (uint64_t)span->first * 0x9E3779B97F4A7C15ULL;
 }
 
-static void set_prev_mini(block_t *block, bool is_prev_mini) {
-    if (is_prev_mini) {
-        block->header |= prev_mini_mask;
+/**
+ * @brief Split a tree into the spans ordered before key and the rest.
+ */
+static void tree_split(span_t *root, span_t *key, span_t **lo, span_t **hi) {
+    if (root == NULL) {
+        *lo = *hi = NULL;
+    } else if (span_less(root, key)) {
+        tree_split(root->right, key, &root->right, hi);
+        *lo = root;
     } else {
-        block->header &= ~prev_mini_mask;
+        tree_split(root->left, key, lo, &root->left);
+        *hi = root;
     }
 }
 
-void write_block(block_t *block, size_t size, bool alloc, bool palloc,
-                        bool pmini) {
-
-    block->header = pack(size, alloc, palloc, pmini);
-
-    // Write footer for regular free blocks
-    if (!alloc) {
-        if (size > min_block_size) {
-            word_t *footerp = header_to_footer(block);
-            *footerp = pack(size, alloc, palloc, pmini);
-        }
+/**
+ * @brief Join two trees, every span of lo ordered before every span of hi.
+ */
+static span_t *tree_merge(span_t *lo, span_t *hi) {
+    if (lo == NULL) {
+        return hi;
     }
-
-    block_t *nxt = find_next(block);
-    set_prev_alloc(nxt, alloc);
-    set_prev_mini(nxt, (size <= min_block_size));
-}
-
-static word_t *find_prev_footer(block_t *block) {
-    // Compute previous footer position as one word before the header
-    return &(block->header) - 1;
-}
-
-static block_t *find_prev(block_t *block) {
-
-    if (get_prev_mini(block)) {
-        return (block_t *)((char *)block - min_block_size);
+    if (hi == NULL) {
+        return lo;
     }
-
-    word_t *footerp = find_prev_footer(block);
-
-    // Return NULL if called on first block in the heap
-    if (extract_size(*footerp) == 0) {
-        return NULL;
+    if (span_priority(lo) > span_priority(hi)) {
+        lo->right = tree_merge(lo->right, hi);
+        return lo;
     }
-
-    return footer_to_header(footerp);
+    hi->left = tree_merge(lo, hi->left);
+    return hi;
 }
 
-short find_size_class(size_t size) {
-    for (short i = 0; i < NUM_CLASSES; i++) {
-        if (i == NUM_CLASSES - 1 ||
-            (size >= size_classes[i] && size < size_classes[i + 1])) {
-            return i;
-        }
-    }
-    assert(false);
-    return 0;
-}
+static void tree_insert(span_t *span) {
+    span_t *lo, *hi;
 
-block_t *find_epilogue() {
-    return (block_t *)((char *)mem_heap_hi() - 7);
+    span->left = span->right = NULL;
+    tree_split(large_spans, span, &lo, &hi);
+    large_spans = tree_merge(tree_merge(lo, span), hi);
 }
 
-void insert_free_block(block_t *block) {
-
-    if (is_miniblock(block)) {
-        miniblock_t *mb = (miniblock_t *)block;
-        mb->next = miniblock_pointer;
-        miniblock_pointer = mb;
-        return;
-    }
-
-    short sc = find_size_class(get_size(block));
-    block_t *sc_pointer = seglists[sc];
-
-    if (sc_pointer == NULL) {
-        sc_pointer = block;
-        set_prev_free(sc_pointer, sc_pointer);
-        set_next_free(sc_pointer, sc_pointer);
-
-        // Update root pointer in size class array
-        seglists[sc] = sc_pointer;
-    } else {
-        block_t *next = find_next_free(sc_pointer);
+static void tree_remove(span_t *span) {
+    span_t **link = &large_spans;
 
-        set_prev_free(block, sc_pointer);
-        set_next_free(sc_pointer, block);
-        set_prev_free(next, block);
-        set_next_free(block, next);
+    while (*link != span) {
+        io_msafe_assert(*link != NULL);
+        link = span_less(span, *link) ? &(*link)->left : &(*link)->right;
     }
+    *link = tree_merge(span->left, span->right);
 }
 
-void remove_free_block(block_t *block) {
+void insert_free_span(span_t *span) {
+    size_t i = span->num_pages - 1;
 
-    if (is_miniblock(block)) {
-        if (block == (block_t *)miniblock_pointer) {
-            miniblock_pointer = (miniblock_pointer->next);
-        } else {
-            miniblock_t *mb = miniblock_pointer;
-            while (mb != NULL && mb->next != NULL) {
-                if (mb->next == (miniblock_t *)block) {
-                    mb->next = mb->next->next;
-                    return;
-                }
-                mb = mb->next;
-            }
-        }
+    span->free = true;
+    if (span->num_pages > _MM_SPAN_LIST_PAGES) {
+        tree_insert(span);
         return;
     }
-
-    // Get parent free list
-    short sc = find_size_class(get_size(block));
-    block_t *sc_pointer = seglists[sc];
-
-    block_t *prev = find_prev_free(block);
-    block_t *next = find_next_free(block);
-
-    if (prev == block) {
-
-        // If block is the only block in list, remove it
-        seglists[sc] = NULL;
-    } else {
-        if (block == sc_pointer) {
-            // if root is removed, move pointer backward in list
-            seglists[sc] = prev;
-        }
-        set_prev_free(next, prev);
-        set_next_free(prev, next);
+    span->prev = NULL;
+    span->next = free_lists[i];
+    if (free_lists[i]) {
+        free_lists[i]->prev = span;
     }
+    free_lists[i] = span;
+    free_list_mask[i / 64] |= 1ULL << (i % 64);
 }
 
-block_t *coalesce_block(block_t *block) {
-
-    bool prev_alloc = get_prev_alloc(block);
+void remove_free_span(span_t *span) {
+    size_t i = span->num_pages - 1;
 
-    size_t prev_size;
-    if (get_prev_mini(block)) {
-        prev_size = min_block_size;
+    io_msafe_assert(span->free);
+    span->free = false;
+    if (span->num_pages > _MM_SPAN_LIST_PAGES) {
+        tree_remove(span);
+        return;
+    }
+    if (span->prev) {
+        span->prev->next = span->next;
     } else {
-        prev_size = extract_size(*(find_prev_footer(block)));
+        free_lists[i] = span->next;
+        if (free_lists[i] == NULL) {
+            free_list_mask[i / 64] &= ~(1ULL << (i % 64));
+        }
     }
-
-    bool next_alloc = get_alloc(find_next(block));
-    size_t next_size = get_size(find_next(block));
-
-    size_t cur_size = get_size(block);
-
-    /* Case 1 */
-    if (prev_alloc && next_alloc) {
-        return block;
+    if (span->next) {
+        span->next->prev = span->prev;
     }
+}
 
-    /* Case 2 */
-    else if (prev_alloc && !next_alloc) {
-        // Remove coalescing block from list
-        remove_free_block(find_next(block));
-        remove_free_block(block);
-
-        // Write new coalesced block
-        bool cur_prev_mini = get_prev_mini(block);
-        write_block(block, cur_size + next_size, false, true, cur_prev_mini);
+span_t *coalesce_span(span_t *span) {
+    span_t *prev, *next;
+    size_t end;
 
-        insert_free_block(block);
-        return block;
+    if (span->first > 0 && (prev = span_map[span->first - 1])->free) {
+        remove_free_span(prev);
+        prev->num_pages += span->num_pages;
+        span_delete(span);
+        span = prev;
     }
-
-    /* Case 3 */
-    else if (!prev_alloc && next_alloc) {
-        block_t *prev = find_prev(block);
-        bool pp_alloc = get_prev_alloc(prev);
-        bool pp_mini = get_prev_mini(prev);
-        remove_free_block(prev);
-        remove_free_block(block);
-        write_block(prev, prev_size + cur_size, false, pp_alloc, pp_mini);
-
-        insert_free_block(prev);
-        return prev;
+    end = span->first + span->num_pages;
+    if (end < heap_pages && (next = span_map[end])->free) {
+        remove_free_span(next);
+        span->num_pages += next->num_pages;
+        span_delete(next);
     }
-
-    /* Case 4 */
-    else if (!prev_alloc && !next_alloc) {
-        block_t *prev = find_prev(block);
-        bool pp_alloc = get_prev_alloc(prev);
-        bool pp_mini = get_prev_mini(prev);
-        remove_free_block(prev);
-        remove_free_block(find_next(block));
-        remove_free_block(block);
-        write_block(prev, prev_size + cur_size + next_size, false, pp_alloc,
-                    pp_mini);
-
-        insert_free_block(prev);
-        return prev;
-    }
-    return NULL;
+    span_register(span);
+    return span;
 }
 
-block_t *extend_heap(size_t size) {
-    void *bp;
-
-    bool prev_block_alloc = get_prev_alloc(find_epilogue());
-    bool prev_block_mini = get_prev_mini(find_epilogue());
+/*
+ * The pieces split_span and trim_span cut off need no coalescing: they
+ * come from a span that was free, whose neighbours were not.
+ */
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = extend_bmp((intptr_t)size)) == (void *)-1) {
-        return NULL;
+void split_span(span_t *span, size_t num_pages) {
+    io_msafe_assert(num_pages <= span->num_pages);
+    if (num_pages == span->num_pages) {
+        return;
     }
-
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-
-    write_block(block, size, false, prev_block_alloc, prev_block_mini);
-
-    // Add new free block to free list
-    insert_free_block(block);
-
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next);
-
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
-
-    return block;
+    insert_free_span(span_new(span->first + num_pages,
+                              span->num_pages - num_pages));
+    span->num_pages = num_pages;
+    span_register(span);
 }
 
-void split_block(block_t *block, size_t asize) {
+span_t *trim_span(span_t *span, size_t num_pages) {
+    span_t *rest;
 
-    size_t block_size = get_size(block);
-
-    if ((block_size - asize) >= min_block_size) {
-        block_t *block_next;
-        write_block(block, asize, true, get_prev_alloc(block),
-                    get_prev_mini(block));
+    io_msafe_assert(num_pages < span->num_pages);
+    rest = span_new(span->first + num_pages, span->num_pages - num_pages);
+    span->num_pages = num_pages;
+    span_register(span);
+    insert_free_span(span);
+    return rest;
+}
 
-        block_next = find_next(block);
-        write_block(block_next, block_size - asize, false, true,
-                    is_miniblock(block));
+span_t *find_fit(size_t num_pages) {
+    span_t *span, *best = NULL;
 
-        insert_free_block(block_next);
+    if (num_pages <= _MM_SPAN_LIST_PAGES) {
+        size_t i = num_pages - 1, w = i / 64;
+        uint64_t bits = free_list_mask[w] & (~0ULL << (i % 64));
+        while (bits == 0 && ++w < _MM_SPAN_LIST_WORDS) {
+            bits = free_list_mask[w];
+        }
+        if (bits) {
+            return free_lists[w * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    for (span = large_spans; span; ) {
+        if (span->num_pages >= num_pages) {
+            best = span;
+            span = span->left;
+        } else {
+            span = span->right;
+        }
     }
+    return best;
 }
 
-block_t *find_fit(size_t asize) {
+span_t *extend_heap(size_t num_pages) {
+    span_t *span, *tail = NULL;
+    size_t incr = num_pages;
 
-    // Find fit for miniblocks (first fit)
-    if (asize <= min_block_size) {
-        if (miniblock_pointer != NULL) {
-            return (block_t *)miniblock_pointer;
-        }
+    if (heap_pages > 0 && span_map[heap_pages - 1]->free) {
+        tail = span_map[heap_pages - 1];
+        incr = (num_pages > tail->num_pages) ? num_pages - tail->num_pages : 0;
     }
-
-    // Find size class
-    short i = find_size_class(asize);
-    while (i < NUM_CLASSES) {
-        block_t *start = seglists[i];
-        block_t *block = start;
-
-        // BEST (BETTER) FIT
-        size_t min_size = (size_t)(-1L);
-        block_t *min_block = NULL;
-        size_t counter = 0;
-
-        while (block != NULL) {
-            size_t block_size = get_size(block);
-
-            if (block_size >= asize && block_size < min_size) {
-                min_size = block_size;
-                min_block = block;
-            }
-            counter++;
-            if (counter == search_depth) {
-                if (min_block != NULL) {
-                    return min_block;
-                } else {
-                    // If not found, restart search on current branch
-                    counter = 0;
-                }
-            }
-
-            block = find_next_free(block);
-            if (block == start) { // End of free list
-                if (min_block != NULL) {
-                    return min_block;
-                }
-                break;
-            }
-        }
-        i++;
+    incr = max(incr, _MM_HEAP_EXTEND_PAGES);
+    if (extend_bmp(incr * _MM_PAGESIZE) == _MM_EXTEND_BMP_FAIL) {
+        return NULL;
+    }
+    if (heap_base == 0) {
+        heap_base = (uintptr_t)mem_heap_lo();
     }
 
-    return NULL;
+    span = span_new(heap_pages, incr);
+    heap_pages += incr;
+    return coalesce_span(span);
 }
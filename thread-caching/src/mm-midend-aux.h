@@ -3,80 +3,40 @@
 
 #include "mm-comm.h"
 
-/** @brief Number of size classes in segregated list */
-#define NUM_CLASSES 9
+/** @brief Free spans of up to this many pages are kept on a list per
+ * page count; longer ones go in the large-span tree */
+#define _MM_SPAN_LIST_PAGES 128
 
-/** @brief Number of samples in average block size estimation */
-#define NUM_ITERS 100
+/** @brief Words in the bitmap of nonempty free lists */
+#define _MM_SPAN_LIST_WORDS ((_MM_SPAN_LIST_PAGES + 63) / 64)
 
-/** @brief Minimum size by which the heap extends */
-#define _MM_HEAP_REQUEST_CHUNKSIZE (1 << 15)
-#define SYS_MM_ALIGN 16
+/** @brief Minimum number of pages by which the heap extends */
+#define _MM_HEAP_EXTEND_PAGES 8
 
-typedef uint64_t word_t;
+/** @brief Span records are mmapped this many bytes at a time */
+#define _MM_SPAN_CHUNK_BYTES 16384
 
-/** @brief Represents the header and payload of one block in the heap */
-typedef struct block {
-    /**
-     * @brief Header contains size + allocation flag
-     */
-    word_t header;
-    union {
-        struct {
-            struct block *prev;
-            struct block *next;
-        } ptrs;
-        char payload[0];
-    };
-} block_t;
+/** @brief Pages the backend can hand out, one span map entry each */
+#define _MM_HEAP_PAGES (TOTAL_ALLOC_SPACE / _MM_PAGESIZE)
 
-/** @brief Represents a fixed-size miniblock in the heap */
-typedef struct miniblock {
-    word_t header;
-    union {
-        struct miniblock *next;
-        char payload[0];
-    };
-} miniblock_t;
-
-/* Basic constants */
-
-/** @brief Word and header size (bytes) */
-static const size_t wsize = sizeof(word_t);
-
-/** @brief Double word size (bytes) */
-static const size_t dsize = 2 * wsize;
-
-/** @brief Minimum block size (bytes) */
-static const size_t min_block_size = _MM_PAGESIZE + dsize;
-
-/** @brief Mask that indicates the allocated bit in header */
-static const word_t alloc_mask = 0x1;
-
-/** @brief Mask that indicates size of block in header */
-static const word_t size_mask = ~(word_t)0xF;
-
-/** @brief Mask that indicates the allocation status of previous block */
-static const word_t prev_alloc_mask = 0x2;
-
-/** @brief Mask that indicates whether the previous consecutive block
- * is a miniblock */
-static const word_t prev_mini_mask = 0x4;
-
-/** @brief How far to search seglists for desired block for best fit policy */
-static const size_t search_depth = 18;
-
-/** @brief Set of size classes for segregated list */
-static const size_t size_classes[] = {
-    min_block_size,
-    2 * min_block_size,
-    3 * min_block_size,
-    4 * min_block_size,
-    5 * min_block_size,
-    8 * min_block_size,
-    16 * min_block_size,
-    32 * min_block_size,
-    64 * min_block_size};
+/**
+ * @brief A run of whole pages in the heap, allocated or free.
+ *
+ * Spans tile the heap from its first page to the break, and are never
+ * written into: the record is out of band, and the span map points the
+ * first and last page of every span at it. That is enough to find a
+ * span from the pointer it was handed out as, and the neighbours of a
+ * span from the pages on either side of it.
+ */
+typedef struct span {
+    size_t first;          /* Index of the first page, from the heap start */
+    size_t num_pages;      /* Pages in the span */
+    struct span *prev;     /* Previous on its free list */
+    struct span *next;     /* Next on its free list, or the record stack */
+    struct span *left;     /* Children in the large-span tree */
+    struct span *right;
+    bool free;             /* On a free list or in the tree */
+} span_t;
 
 /**
  * @brief Returns the maximum of two integers.
@@ -95,182 +55,99 @@ size_t max(size_t x, size_t y);
 size_t round_up(size_t size, size_t n);
 
 /**
- * @brief Packs the `size` and `alloc` of a block into a word suitable for
- *        use as a packed value.
- *
- * Packed values are used for both headers and footers.
- *
- * The allocation status is packed into the lowest bit of the word.
- *
- * @param[in] size The size of the block being represented
- * @param[in] alloc True if the block is allocated
- * @return The packed value
- */
-word_t pack(size_t size, bool alloc, bool palloc, bool pmini);
-
-/**
- * @brief Extracts the size represented in a packed word.
- *
- * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
- *
- * @param[in] word
- * @return The size of the block represented by the word
- */
-size_t extract_size(word_t word);
-
-/**
- * @brief Extracts the size of a block from its header.
- * @param[in] block
- * @return The size of the block
- */
-size_t get_size(block_t *block);
-
-/**
- * @brief Extracts the alloc of a block from its header.
- * @param[in] block
- * @return The alloc of the block
+ * @brief Returns the address of the first page of a span.
+ * @param[in] span
+ * @return A page-aligned pointer into the heap
  */
-bool get_alloc(block_t *block);
+void *span_address(span_t *span);
 
 /**
- * @brief Return whether the previous block is a miniblock.
- * @param[in] block A block in the heap.
- * @return whether the previous block is a miniblock.
+ * @brief Find the span a pointer was handed out as.
+ * @param[in] ptr A pointer returned by the midend
+ * @return The span starting at ptr, or NULL if there is none
  */
-bool get_prev_mini(block_t *block);
+span_t *span_of(void *ptr);
 
 /**
- * @brief Returns the allocation status of the previous block.
- * @param[in] block
- * @return The allocation status of the previous block
+ * @brief Get a record for a new span and register its first and last
+ * pages in the span map.
+ * @param[in] first Index of the first page of the span
+ * @param[in] num_pages Pages in the span
+ * @return The new span, which is on no free list
  */
-bool get_prev_alloc(block_t *block);
+span_t *span_new(size_t first, size_t num_pages);
 
 /**
- * @brief Given a payload pointer, returns a pointer to the corresponding
- *        block.
- * @param[in] bp A pointer to a block's payload
- * @return The corresponding block
+ * @brief Point the span map entries of a span's first and last pages at
+ * it, after it has changed size.
+ * @param[in] span
  */
-block_t *payload_to_header(void *bp);
+void span_register(span_t *span);
 
 /**
- * @brief Given a block pointer, returns a pointer to the corresponding
- *        payload.
- * @param[in] block
- * @return A pointer to the block's payload
- * @pre The block must be a valid block, not a boundary tag.
+ * @brief Put a span on the free list for its page count, or in the
+ * large-span tree if it is longer than _MM_SPAN_LIST_PAGES.
+ * @param[in] span A span on no free list
  */
-void *header_to_payload(block_t *block);
+void insert_free_span(span_t *span);
 
 /**
- * @brief Given a block pointer, returns a pointer to the corresponding
- *        footer.
- * @param[in] block
- * @return A pointer to the block's footer
- * @pre The block must be a valid block, not a boundary tag.
+ * @brief Take a span off its free list or out of the large-span tree.
+ * @param[in] span A free span
  */
-word_t *header_to_footer(block_t *block);
+void remove_free_span(span_t *span);
 
 /**
- * @brief Given a block footer, returns a pointer to the corresponding
- *        header.
- * @param[in] footer A pointer to the block's footer
- * @return A pointer to the start of the block
- * @pre The footer must be the footer of a valid block, not a boundary tag.
- */
-block_t *footer_to_header(word_t *footer);
-
-/**
- * @brief Returns the payload size of a given block.
+ * @brief Merge a span with any free spans on either side of it.
  *
- * The payload size is equal to the entire block size minus the sizes of the
- * block's header and footer.
+ * The free neighbours come off their lists and their records are
+ * recycled; the merged span is not inserted.
  *
- * @param[in] block
- * @return The size of the block's payload
+ * @param[in] span A span on no free list
+ * @return The merged span, which may start before span did
  */
-size_t get_payload_size(block_t *block);
+span_t *coalesce_span(span_t *span);
 
 /**
- * @brief Writes a block starting at the given address.
- *
- * This function writes both a header and footer, where the location of the
- * footer is computed in relation to the header.
- *
- * @param[out] block The location to begin writing the block header
- * @param[in] size The size of the new block
- * @param[in] alloc The allocation status of the new block
+ * @brief Cut a span down to its first num_pages pages, and put the
+ * rest back on the free lists.
+ * @param[in] span A span on no free list
+ * @param[in] num_pages Pages to keep, at most span->num_pages
  */
-void write_block(block_t *block, size_t size, bool alloc, bool palloc,
-                        bool pmini);
+void split_span(span_t *span, size_t num_pages);
 
 /**
- * @brief Find the size class of a block size.
-*/
-short find_size_class(size_t size);
-
-/**
- * @brief Find the epilogue of the current heap.
- * @return a pointer to the epilogue.
-*/
-block_t *find_epilogue(void);
-
-/**
- * @brief Insert a free block into the free list.
- *
- * Insert the block into the smallest size class in which it fits.
- *
- * @param[in] The block to be inserted.
+ * @brief Drop the first num_pages pages of a span back on the free
+ * lists.
+ * @param[in] span A span on no free list
+ * @param[in] num_pages Pages to cut off, less than span->num_pages
+ * @return The span made of the remaining pages
  */
-void insert_free_block(block_t *block);
+span_t *trim_span(span_t *span, size_t num_pages);
 
 /**
- * @brief Remove the indicated block from the free list.
- * Given a block, search the seglist for the list that contains that block
- * and remove block from that list.
+ * @brief Find the smallest free span of at least num_pages pages.
  *
- * @param[in] block The block to be removed.
- */
-void remove_free_block(block_t *block);
-
-/**
- * @brief Given a free block, coalesce the block with its neighbors.
- *
- * Remove the block along with each free neighbor from the free list and
- * write a new free block with the size of the sum of each of the free blocks,
- * and add that block to the free list.
- *
- * @param[in] block The block to be coalesced.
- * @return A pointer to the newly coalesced block.
- */
-block_t *coalesce_block(block_t *block);
-
-/**
- * @brief Extend the heap by a given number of bytes.
- *
- * @param[in] size The number of bytes to extend the heap by
+ * Spans that short are taken from the first nonempty list at or above
+ * num_pages; longer requests take the shortest, then lowest, span in
+ * the large-span tree.
  *
- * @return A pointer to the first free block of the newly extended heap
+ * @param[in] num_pages The minimum number of pages
+ * @return A free span, still on its list, or NULL if there is none
  */
-block_t *extend_heap(size_t size);
+span_t *find_fit(size_t num_pages);
 
 /**
- * @brief Split an allocated block into allocated and free segments
+ * @brief Extend the heap so that its last span is free and at least
+ * num_pages pages long.
  *
- * @param[in] block The block to split
- * @param[in] asize The size of the allocated segment of the block
- */
-void split_block(block_t *block, size_t asize);
-
-/**
- * @brief Find a free block for a given block size.
+ * Only the pages the free span at the end of the heap lacks are asked
+ * of the backend, but never fewer than _MM_HEAP_EXTEND_PAGES.
  *
- * @param[in] asize The minimum size of the free block to be returned
- * @return A pointer to an appropriate free block on the heap, or
- * NULL if there is none
+ * @param[in] num_pages The minimum number of pages
+ * @return The free span at the end of the heap, on no free list, or
+ * NULL if the backend is out of memory
  */
-block_t *find_fit(size_t asize);
+span_t *extend_heap(size_t num_pages);
 
-#endif /* _MM_MIDEND_AUX_H */
\ No newline at end of file
+#endif /* _MM_MIDEND_AUX_H */
@@ -1,168 +1,109 @@
 /**
- * @file mm-frontend.c
+ * @file mm-midend.c
  * @author Makoto Tomokiyo <mtomokiy@andrew.cmu.edu>
- * @brief An interface to the custom malloc suite.
+ * @brief The central page heap: hands out page-aligned spans of whole
+ * pages to the frontend, and coalesces them by page adjacency when they
+ * come back. Span records are kept out of band (see mm-midend-aux.h), so
+ * a span is all payload.
  * WARNING: Do not call malloc-dependent library functions (such as printf)
  *          from within any functions in this file. This will deadlock.
- * TODO: get rid of miniblock business
 */
 
 #include "mm-backend.h"
 #include "mm-midend.h"
 #include "mm-midend-aux.h"
 
-extern block_t *heap_start;
-extern miniblock_t *miniblock_pointer;
-extern block_t *seglists[];
-extern size_t pagesize;
-
 /* Access to central free list is serialized but uncommon */
 pthread_mutex_t midend_central_freelist = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * @brief Initialize the central page heap.
- * @return true if initialization was successful
+ * @brief Take a free span of at least num_pages pages off the free
+ * lists, extending the heap if none is long enough.
+ * @return the span, on no free list, or NULL if out of memory
  */
-static bool _init_heap(void) {
-    int trylock_return;
-    uint64_t *start;
-
-    trylock_return = pthread_mutex_trylock(&midend_central_freelist);
-    switch (trylock_return) {
-        case 0:
-        case EBUSY: // either thread gets it, or another is using
-            break;
-        case EINVAL:
-            io_msafe_eprintf("Fatal: Uninitialized mutex.\n");
-            exit(1);
-        default:
-            return false;
-    }
-    /* Lock acquired */
-
-    // Create the initial empty heap
-    if ((start = (uint64_t *)(extend_bmp(2 * wsize))) == _MM_EXTEND_BMP_FAIL)
-        goto _init_heap_failure;
-
-    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
-
-    /* Reset global variables */
+static span_t *take_span(size_t num_pages) {
+    span_t *span = find_fit(num_pages);
 
-    heap_start = (block_t *)&(start[1]);
-
-    // Reset all size class pointers
-    memset(seglists, 0, NUM_CLASSES * sizeof(void *));
-
-    if (extend_heap(_MM_HEAP_REQUEST_CHUNKSIZE) == NULL) {
-        goto _init_heap_failure;
+    if (span == NULL) {
+        return extend_heap(num_pages);
     }
-
-    // NOTE: 
-    insert_free_block((block_t *)heap_start);
-
-    pthread_mutex_unlock(&midend_central_freelist);
-    return true;
-
-_init_heap_failure:
-    pthread_mutex_unlock(&midend_central_freelist);
-    return false;
+    remove_free_span(span);
+    return span;
 }
 
 /**
  * @brief Return a pointer to a contiguous block of num_pages pages.
  * @param[in] num_pages Number of pages requested by frontend
- * @return pointer to allocated payload, NULL if error occurred.
+ * @return pointer to the first page, NULL if error occurred.
  */
 void *_mm_midend_request_pages(size_t num_pages) {
-    return _mm_midend_request_bytes(num_pages * _MM_PAGESIZE);
-}
-
-void *_mm_midend_request_bytes(size_t num_bytes) {
-    size_t request_size, extendsize;
-    block_t *block;
+    span_t *span;
     void *bp = NULL;
 
-    // Initialize heap if it isn't already
-    if (heap_start == NULL) {
-        _init_heap();
-    }
-
     // Ignore spurious request
-    if (num_bytes == 0) {
+    if (num_pages == 0) {
         io_msafe_eprintf_dbg("Error: requesting 0 pages.\n");
         return bp; // NULL
     }
 
     pthread_mutex_lock(&midend_central_freelist);
-
-    // Adjust block size to include overhead and to meet alignment
-    // requirements
-    request_size = round_up(num_bytes + wsize, SYS_MM_ALIGN);
-
-    // Search the free list for a fit
-    block = find_fit(request_size);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(request_size, _MM_HEAP_REQUEST_CHUNKSIZE);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            goto _malloc_finish;
-        }
+    if ((span = take_span(num_pages)) != NULL) {
+        split_span(span, num_pages);
+        bp = span_address(span);
     }
+    pthread_mutex_unlock(&midend_central_freelist);
+    return bp;
+}
 
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-
-    // Remove new allocated block from free list
-    remove_free_block(block);
-
-    // Write block
-    bool prev_alloc = get_prev_alloc(block);
-    bool prev_mini = get_prev_mini(block);
-    write_block(block, block_size, true, prev_alloc, prev_mini);
-
-    // Try to split the block if too large
-    split_block(block, request_size);
+/**
+ * @brief Return a pointer to num_pages pages whose address is a multiple
+ * of align, a power of two no smaller than a page. The span is fitted
+ * with room to slide up to the boundary; the pages skipped go back on the
+ * free lists, as do any left over at the end.
+ * @return pointer to the first page, NULL if error occurred.
+ */
+void *_mm_midend_request_aligned(size_t num_pages, size_t align) {
+    size_t align_pages = align / _MM_PAGESIZE, lead;
+    uintptr_t addr;
+    span_t *span;
+    void *bp = NULL;
 
-    bp = header_to_payload(block);
+    io_msafe_assert((align & (align - 1)) == 0 && align_pages > 0);
+    if (num_pages == 0) {
+        io_msafe_eprintf_dbg("Error: requesting 0 pages.\n");
+        return bp; // NULL
+    }
 
-_malloc_finish:
+    pthread_mutex_lock(&midend_central_freelist);
+    if ((span = take_span(num_pages + align_pages - 1)) != NULL) {
+        addr = (uintptr_t)span_address(span);
+        lead = (round_up(addr, align) - addr) / _MM_PAGESIZE;
+        if (lead > 0) {
+            span = trim_span(span, lead);
+        }
+        split_span(span, num_pages);
+        bp = span_address(span);
+    }
     pthread_mutex_unlock(&midend_central_freelist);
     return bp;
 }
 
 void _mm_midend_return(void *ptr) {
+    span_t *span;
 
     if (ptr == NULL) return;
 
-    // cannot free if heap is uninit
-    if (!heap_start) {
-        io_msafe_eprintf("Fatal: cannot return on uninit heap.\n");
-    }
-
     pthread_mutex_lock(&midend_central_freelist);
-    
-    block_t *block = payload_to_header(ptr);
-    size_t size = get_size(block);
 
-    if (!get_alloc(block))  {
-        io_msafe_eprintf("Fatal: cannot return freed block.\n");
+    span = span_of(ptr);
+    if (span == NULL || span->free) {
+        io_msafe_eprintf("Fatal: cannot return %p, not an allocated span.\n",
+                         ptr);
         exit(1);
     }
 
-    // Mark the block as free
-    bool prev_alloc = get_prev_alloc(block);
-    bool prev_mini = get_prev_mini(block);
-    write_block(block, size, false, prev_alloc, prev_mini);
-
-    insert_free_block(block);
-
-    // Try to coalesce the block with its neighbors
-    coalesce_block(block);
+    // Merge with free neighbours, then make the whole run available
+    insert_free_span(coalesce_span(span));
 
     pthread_mutex_unlock(&midend_central_freelist);
 }
@@ -7,8 +7,8 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 
-void *_mm_midend_request_bytes(size_t num_bytes);
 void *_mm_midend_request_pages(size_t num_pages);
+void *_mm_midend_request_aligned(size_t num_pages, size_t align);
 void _mm_midend_return(void *ptr);
 
 #endif /*_MM_MIDEND_H */
@@ -4,87 +4,221 @@
  * caching threads in the allocator.
  * @author Makoto Tomokiyo <mtomokiy@andrew.cmu.edu>
  * 
- * Divides the lower 48 bits of addresses in the pageheap into 
- * 4 runs of 12 bits. Lower 12 bits (page offset) are discarded.
- * Each set of 12 bits is used to index into an entry in a three-level
- * radix tree that terminates with the size class index of the 
- * provided pointer.
+ * A two-level radix tree over the 48-bit user address space. The page
+ * offset (low 12 bits) is discarded; the next PM_LEAF_BITS index into a
+ * leaf, and the top PM_ROOT_BITS into the root. A lookup is two
+ * dependent loads.
+ *
+ * Superblocks register every page, since an object may start on any of
+ * them; setting a range costs one walk per leaf plus a store per page.
+ * Large spans only register their first and last page: free() is only
+ * ever passed the first.
+ *
+ * The root is a static array, so it is reserved with the library and
+ * only the pages that get written are ever backed. Leaves are carved
+ * from a MAP_NORESERVE pool of PM_POOL_LEAVES leaves, mapped by the
+ * first insertion; a leaf is only backed where spans are registered.
+ * Leaves are added under a lock, which is taken once per GiB of address
+ * space the heap touches, never on lookup.
 */
 
 #include "mm-pagemap.h"
 #include "pthread.h"
 
-// static pthread_mutex_t pageheap_lock = PTHREAD_MUTEX_INITIALIZER;
-const int pm_block_size = sizeof(pagemap_block_t);
-static pagemap_block_t *pagemap_root = NULL;
-// typedef struct {
-//   void *p;
-//   struct superblock_descriptor *desc;
-// } p2desc;
-// static p2desc *map = NULL;
-// static size_t map_size = 0;
-// static size_t map_capacity = 0;
-
-static inline void decompose_ptr(void *ptr, size_t *indices) {
-  uintptr_t raw = (uintptr_t)ptr;
-  const size_t mask = (~1UL) >> (64 - PM_INDEX_WIDTH);
-  for (int i = 0; i < PM_LEVELS; i++) {
-    indices[i] = raw & mask;
-    raw >>= 12;
+static pagemap_leaf_t *pagemap_root[PM_ROOT_LENGTH];
+
+static pthread_mutex_t pagemap_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pagemap_leaf_t *pagemap_pool = NULL;
+static size_t pagemap_pool_used = 0;
+
+__thread pagemap_cache_t _pagemap_cache
+  __attribute__ ((tls_model("initial-exec")));
+uint64_t _pagemap_epoch = 0;
+#ifdef _MMF_ALIGNED_SB
+struct superblock_descriptor *_pagemap_chunk_desc[PM_CHUNKS];
+uint8_t _pagemap_chunk_sc[PM_CHUNKS];
+uintptr_t _pagemap_chunk_base = 0; /* set by the first pagemap_set_chunk */
+#endif
+#ifdef _MMF_PAGEMAP_STATS
+static uint64_t pagemap_cache_hits = 0;
+static uint64_t pagemap_cache_misses = 0;
+#endif
+
+static inline size_t root_index(void *ptr) {
+  return (uintptr_t)ptr >> (PM_PAGE_SHIFT + PM_LEAF_BITS);
+}
+
+static inline size_t leaf_index(void *ptr) {
+  return ((uintptr_t)ptr >> PM_PAGE_SHIFT) & (PM_LEAF_LENGTH - 1);
+}
+
+/* Map len bytes that are only backed once touched. Exits on failure. */
+static void *map_noreserve(size_t len) {
+  void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    io_msafe_eprintf("FAILURE. mmap couldn't reserve %lu bytes for the "
+                     "pagemap (%s)\n", len, strerror(errno));
+    exit(1);
+  }
+  return mem;
+}
+
+/* Install the leaf for root slot idx if there is none yet. */
+static pagemap_leaf_t *grow_leaf(size_t idx) {
+  pagemap_leaf_t *leaf;
+
+  pthread_mutex_lock(&pagemap_grow_lock);
+  leaf = pagemap_root[idx];
+  if (leaf == NULL) {
+    if (pagemap_pool == NULL) {
+      pagemap_pool = map_noreserve(PM_POOL_LEAVES * sizeof(pagemap_leaf_t));
+    }
+    if (pagemap_pool_used < PM_POOL_LEAVES) {
+      leaf = &pagemap_pool[pagemap_pool_used++];
+    } else {
+      leaf = map_noreserve(sizeof(pagemap_leaf_t));
+    }
+    pagemap_root[idx] = leaf; // zeroed by mmap before lookups can see it
   }
+  pthread_mutex_unlock(&pagemap_grow_lock);
+  return leaf;
 }
 
-static void *test_and_set_ptr(void **loc, size_t size) {
-  void *newblock;
-  if (*loc != NULL) return *loc;
-  newblock = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!_mmf_cas64((uint64_t *)loc, (uint64_t)newblock, 0UL)) {
-      munmap(newblock, size); // free if CAS fails
+/* Leaf holding ptr's page, or NULL if none has been installed */
+static inline pagemap_leaf_t *pagemap_walk(void *ptr) {
+  size_t idx = root_index(ptr);
+
+  if (idx >= PM_ROOT_LENGTH) {
+    return NULL; // not a user-space address
   }
-  return *loc;
+  return pagemap_root[idx];
 }
 
 struct superblock_descriptor *pagemap_lookup(void *ptr) {
-  // pthread_mutex_lock(&pageheap_lock);
-  // size_t idx = find_idx_less_than(ptr);
-  // return map[idx].desc;
-  // pthread_mutex_unlock(&pageheap_lock);
-  size_t indices[4];
-  pagemap_block_t *current = pagemap_root;
-  struct superblock_descriptor *owner;
-  decompose_ptr(ptr, indices);
-  for (int i = 0; i < PM_LEVELS; i++) {
-    if (current == NULL)
-      return NULL;
-    current = current->next_nonterminal[indices[i]];
+  pagemap_leaf_t *leaf;
+#ifdef _MMF_ALIGNED_SB
+  size_t chunk = pagemap_chunk_index(ptr);
+  if (chunk < PM_CHUNKS && _pagemap_chunk_desc[chunk] != PM_NOEXIST) {
+    return _pagemap_chunk_desc[chunk];
+  }
+#endif
+  leaf = pagemap_walk(ptr);
+  return leaf ? leaf->desc[leaf_index(ptr)] : PM_NOEXIST;
+}
+
+pagemap_cache_entry *pagemap_cache_fill(void *ptr) {
+  uintptr_t page = (uintptr_t)ptr >> PM_PAGE_SHIFT;
+  uint64_t epoch = _pagemap_epoch;
+  pagemap_cache_entry *entry;
+  pagemap_leaf_t *leaf;
+  size_t i;
+
+#ifdef _MMF_PAGEMAP_STATS
+  _pagemap_cache.misses++;
+#endif
+  if (_pagemap_cache.epoch != epoch) {
+    memset(_pagemap_cache.entries, 0, sizeof(_pagemap_cache.entries));
+    _pagemap_cache.epoch = epoch;
+  }
+  /* read the epoch before the tree: a page cleared after this load
+     bumps it again, so the entry below is never trusted past that */
+  __asm__ volatile("" ::: "memory");
+  leaf = pagemap_walk(ptr);
+  i = leaf_index(ptr);
+  if (leaf == NULL || leaf->desc[i] == PM_NOEXIST) {
+    return NULL;
+  }
+  entry = &_pagemap_cache.entries[page & (PM_CACHE_ENTRIES - 1)];
+  entry->key = page << PM_CLASS_BITS | leaf->sc[i];
+  entry->desc = leaf->desc[i];
+  return entry;
+}
+
+void pagemap_set_span(void *start, size_t num_pages,
+                      struct superblock_descriptor *desc) {
+  uint8_t sc = desc ? desc->sc_index + 1 : 0;
+  uint8_t *ptr = start;
+  bool replaced = false;
+  uint64_t epoch;
+
+  io_msafe_assert(desc == NULL || desc->sc_index < UINT8_MAX);
+  while (num_pages > 0) {
+    size_t idx = root_index(ptr), i = leaf_index(ptr);
+    size_t n = PM_LEAF_LENGTH - i; /* pages left in this leaf */
+    pagemap_leaf_t *leaf;
+
+    if (n > num_pages) {
+      n = num_pages;
+    }
+
+    io_msafe_assert(idx < PM_ROOT_LENGTH);
+    leaf = pagemap_root[idx];
+    if (leaf == NULL) {
+      leaf = grow_leaf(idx);
+    }
+    for (size_t end = i + n; i < end; i++) {
+      replaced |= leaf->desc[i] != PM_NOEXIST && leaf->desc[i] != desc;
+      leaf->desc[i] = desc;
+      leaf->sc[i] = sc;
+    }
+    ptr += n * _MM_PAGESIZE;
+    num_pages -= n;
+  }
+  if (replaced) {
+    /* after the stores, so a lookup that saw an old owner is stale */
+    do {
+      epoch = _pagemap_epoch;
+    } while (!_mmf_cas64(&_pagemap_epoch, epoch + 1, epoch));
   }
-  owner = (struct superblock_descriptor *)current;
-  return owner;
 }
 
-void pagemap_reallocate(void *ptr, struct superblock_descriptor *owner) {
-  // pthread_mutex_lock(&pageheap_lock);
-  // if (map == NULL) {
-  //   map_capacity = (1 << 25) * sizeof(p2desc);
-  //   map = mmap(NULL, map_capacity, PROT_READ | PROT_WRITE,
-  //                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  // }
-  // if (!map) exit(1);
-  // size_t idx = find_idx_less_than(ptr);
-  // memmove(&map[idx + 1], &map[idx], map_size - idx);
-  // map_size++;
-  // map[idx].p = ptr;
-  // map[idx].desc = owner;
-  // pthread_mutex_unlock(&pageheap_lock);
-  size_t indices[4];
-  pagemap_block_t **current = &pagemap_root;
-  decompose_ptr(ptr, indices);
-  for (int i = 0; i < PM_LEVELS; i++) {
-    
-    pagemap_block_t *next_level = test_and_set_ptr(
-                                  (void **)current, pm_block_size);
-    current = &next_level->next_nonterminal[indices[i]];
+#ifdef _MMF_ALIGNED_SB
+void pagemap_set_chunk(void *chunk, struct superblock_descriptor *desc) {
+  size_t i;
+
+  io_msafe_assert(((uintptr_t)chunk & (_MMF_SB_CHUNK_BYTES - 1)) == 0);
+  if (_pagemap_chunk_base == 0) {
+    /* the heap exists by now; every caller computes the same base */
+    _pagemap_chunk_base = (uintptr_t)mem_heap_lo() >> _MMF_SB_CHUNK_SHIFT;
+  }
+  i = pagemap_chunk_index(chunk);
+  io_msafe_assert(i < PM_CHUNKS);
+  /* class byte last on the way in and first on the way out, so free()
+     never sees a class whose descriptor is missing */
+  if (desc) {
+    _pagemap_chunk_desc[i] = desc;
+    _pagemap_chunk_sc[i] = desc->sc_index + 1;
+  } else {
+    _pagemap_chunk_sc[i] = 0;
+    _pagemap_chunk_desc[i] = PM_NOEXIST;
   }
-  *current = (pagemap_block_t *)owner;
-}
\ No newline at end of file
+}
+#endif
+
+void pagemap_cache_retire(void) {
+#ifdef _MMF_PAGEMAP_STATS
+  uint64_t n;
+  do {
+    n = pagemap_cache_hits;
+  } while (!_mmf_cas64(&pagemap_cache_hits, n + _pagemap_cache.hits, n));
+  do {
+    n = pagemap_cache_misses;
+  } while (!_mmf_cas64(&pagemap_cache_misses, n + _pagemap_cache.misses, n));
+  _pagemap_cache.hits = 0;
+  _pagemap_cache.misses = 0;
+#endif
+}
+
+#ifdef _MMF_PAGEMAP_STATS
+/* Print the hit rate over every thread, including this one. */
+__attribute__ ((destructor)) static void pagemap_cache_report(void) {
+  uint64_t hits, total;
+
+  pagemap_cache_retire();
+  hits = pagemap_cache_hits;
+  total = hits + pagemap_cache_misses;
+  io_msafe_eprintf("pagemap cache: %lu of %lu lookups hit (%lu%%)\n",
+                   hits, total, total ? hits * 100 / total : 0);
+}
+#endif
@@ -5,23 +5,148 @@
 #include "mm-cache-defines.h"
 #include "mm-frontend-aux.h"
 
-#define PM_LEVELS (4)
-#define PM_INDEX_WIDTH (12)
-#define PM_BLOCK_INDICES (1UL << PM_INDEX_WIDTH)
+#define PM_PAGE_SHIFT (12)
+#define PM_ADDRESS_BITS (48) /* user-space addresses on x86-64 */
+#define PM_LEAF_BITS (18)    /* a leaf maps 1 GiB of address space */
+#define PM_ROOT_BITS (PM_ADDRESS_BITS - PM_PAGE_SHIFT - PM_LEAF_BITS)
+#define PM_LEAF_LENGTH (1UL << PM_LEAF_BITS)
+#define PM_ROOT_LENGTH (1UL << PM_ROOT_BITS)
+#define PM_POOL_LEAVES (16)  /* leaves reserved by the first insertion */
+#define PM_CACHE_ENTRIES (64) /* per-thread lookup cache, a power of 2 */
+#define PM_CLASS_BITS (8)    /* class byte packed under a cached page */
 #define PM_NOEXIST (NULL)
 
-typedef struct superblock_descriptor *sb_desc_pair[2];
+/**
+ * Descriptors of PM_LEAF_LENGTH consecutive pages, and next to them the
+ * size class of each, so a lookup that only needs the class reads one
+ * byte. A class byte holds sc_index + 1, and 0 for an unregistered page.
+ * 2.25 MiB, mostly untouched.
+*/
+typedef struct pagemap_leaf {
+  struct superblock_descriptor *desc[PM_LEAF_LENGTH];
+  uint8_t sc[PM_LEAF_LENGTH];
+} pagemap_leaf_t;
 
-typedef struct pagemap_block pagemap_block_t;
-struct pagemap_block {
-  pagemap_block_t *next_nonterminal[PM_BLOCK_INDICES];
-};
+/**
+ * Per-thread, direct-mapped cache of page number -> descriptor and class
+ * in front of the tree, since frees tend to hit the same few pages in a
+ * row. Only pages with a descriptor are cached. pagemap_set_span bumps
+ * _pagemap_epoch whenever a page loses its descriptor, and a cache that
+ * sees a new epoch starts over, so no entry outlives its page's owner.
+ * Build with -D_MMF_PAGEMAP_STATS to count hits and misses; the totals
+ * are printed at exit.
+*/
+typedef struct {
+  uintptr_t key;                      /* Page number << PM_CLASS_BITS |
+                                         its class byte; 0 if empty */
+  struct superblock_descriptor *desc; /* Its descriptor */
+} pagemap_cache_entry;
 
-/* Return size class of the  */
+typedef struct {
+  uint64_t epoch;                     /* _pagemap_epoch the entries are from */
+  pagemap_cache_entry entries[PM_CACHE_ENTRIES];
+#ifdef _MMF_PAGEMAP_STATS
+  uint64_t hits;
+  uint64_t misses;
+#endif
+} pagemap_cache_t;
+
+extern __thread pagemap_cache_t _pagemap_cache
+  __attribute__ ((tls_model("initial-exec")));
+extern uint64_t _pagemap_epoch __attribute__ ((visibility("hidden")));
+
+#ifdef _MMF_ALIGNED_SB
+/**
+ * Superblocks are whole _MMF_SB_CHUNK_BYTES chunks of the backend heap,
+ * so their descriptor and class sit in flat tables indexed by chunk
+ * number, counted from the heap's first chunk. Large spans never share
+ * a chunk with a superblock, and are still found through the pagemap.
+*/
+#define PM_CHUNKS ((TOTAL_ALLOC_SPACE >> _MMF_SB_CHUNK_SHIFT) + 1)
+
+extern struct superblock_descriptor *_pagemap_chunk_desc[PM_CHUNKS]
+  __attribute__ ((visibility("hidden")));
+extern uint8_t _pagemap_chunk_sc[PM_CHUNKS]
+  __attribute__ ((visibility("hidden")));
+extern uintptr_t _pagemap_chunk_base __attribute__ ((visibility("hidden")));
+
+/* Map the superblock chunk at chunk to desc, or unregister it if NULL */
+void pagemap_set_chunk(void *chunk, struct superblock_descriptor *desc);
+
+/* Table index of ptr's chunk; PM_CHUNKS or more if outside the heap */
+static inline size_t pagemap_chunk_index(void *ptr) {
+  return ((uintptr_t)ptr >> _MMF_SB_CHUNK_SHIFT) - _pagemap_chunk_base;
+}
+#endif
+
+/* Return the descriptor of the span containing ptr's page, or NULL */
 struct superblock_descriptor *pagemap_lookup(void *ptr);
 
-/* Initialize lookup location, or transfer ownership if already used */
-void pagemap_reallocate(void *ptr, struct superblock_descriptor *owner);
+/* Look ptr's page up in the tree and cache it; NULL if unregistered */
+pagemap_cache_entry *pagemap_cache_fill(void *ptr);
+
+/**
+ * @brief Map num_pages pages from start to desc, or unregister them if
+ * desc is NULL: one tree walk per leaf the range crosses, not per page.
+ * desc->sc_index must already be set.
+*/
+void pagemap_set_span(void *start, size_t num_pages,
+                      struct superblock_descriptor *desc);
+
+/* Fold this thread's cache hit counts into the totals, at thread exit */
+void pagemap_cache_retire(void);
+
+/**
+ * @brief This thread's cache entry for ptr's page, filled from the tree
+ * on a miss; NULL if the page is unregistered. A hit is one TLS-relative
+ * load and two compares.
+*/
+static inline pagemap_cache_entry *pagemap_cache_find(void *ptr) {
+  uintptr_t page = (uintptr_t)ptr >> PM_PAGE_SHIFT;
+  pagemap_cache_entry *entry =
+    &_pagemap_cache.entries[page & (PM_CACHE_ENTRIES - 1)];
+
+  if ((entry->key >> PM_CLASS_BITS) == page &&
+      _pagemap_cache.epoch == _pagemap_epoch) {
+#ifdef _MMF_PAGEMAP_STATS
+    _pagemap_cache.hits++;
+#endif
+    return entry;
+  }
+  return pagemap_cache_fill(ptr);
+}
+
+/* pagemap_lookup through this thread's cache */
+static inline struct superblock_descriptor *pagemap_lookup_cached(void *ptr) {
+  pagemap_cache_entry *entry;
+#ifdef _MMF_ALIGNED_SB
+  size_t chunk = pagemap_chunk_index(ptr);
+  if (chunk < PM_CHUNKS && _pagemap_chunk_desc[chunk] != PM_NOEXIST) {
+    return _pagemap_chunk_desc[chunk];
+  }
+#endif
+  entry = pagemap_cache_find(ptr);
+  return entry ? entry->desc : PM_NOEXIST;
+}
 
+/**
+ * @brief Size class index of the span containing ptr, through this
+ * thread's cache: _MMF_LARGE_SC_INDEX for a large span, -1 if the page
+ * is unregistered. Never touches the descriptor.
+*/
+static inline short pagemap_class_cached(void *ptr) {
+  pagemap_cache_entry *entry;
+#ifdef _MMF_ALIGNED_SB
+  size_t chunk = pagemap_chunk_index(ptr);
+  if (chunk < PM_CHUNKS && _pagemap_chunk_sc[chunk] != 0) {
+    return (short)_pagemap_chunk_sc[chunk] - 1;
+  }
+#endif
+  entry = pagemap_cache_find(ptr);
+  if (entry == NULL) {
+    return -1;
+  }
+  return (short)(entry->key & ((1 << PM_CLASS_BITS) - 1)) - 1;
+}
 
-#endif // _MM_PAGEMAP_H
\ No newline at end of file
+#endif // _MM_PAGEMAP_H
@@ -0,0 +1,90 @@
+/**
+ * @file mm-transfer.c
+ * @brief Central per-size-class transfer cache (as in tcmalloc's
+ * TransferCache), so objects freed by one thread are reused by another
+ * instead of each thread growing its own superblocks.
+ *
+ * Each class is a lock-free stack of batches. A batch is linked through
+ * its objects, so it needs no memory of its own: every object's first
+ * word points to the next object of the batch, and the first object's
+ * second word points to the batch below it. Classes are at least 16
+ * bytes, so both words fit. Pushing or popping a whole batch is one
+ * compare-and-swap on the class' anchor.
+*/
+
+#include "mm-transfer.h"
+#include "mm-frontend-aux.h"
+
+/* User-space addresses fit in 48 bits; the top 16 hold a tag or count */
+#define TC_PTR_MASK ((1UL << 48) - 1)
+#define TC_HIGH_SHIFT (48)
+
+/* Layout of the first object of a batch */
+typedef struct transfer_batch {
+  struct transfer_batch *next_obj; /* Next object in this batch, or NULL */
+  uint64_t below;                  /* Batch under this one, and in the top
+                                      16 bits the depth from this one down */
+} transfer_batch;
+
+/* Anchor: top batch in the low 48 bits, and a tag in the top 16 that
+   every update bumps, so a stale snapshot fails its compare-and-swap
+   even if the same batch is back on top. */
+static uint64_t _mmf_transfer[_MMF_NUM_SIZE_CLASSES];
+
+static inline transfer_batch *tc_ptr(uint64_t word) {
+  return (transfer_batch *)(word & TC_PTR_MASK);
+}
+
+static inline uint64_t tc_high(uint64_t word) {
+  return word >> TC_HIGH_SHIFT;
+}
+
+static inline uint64_t tc_pack(transfer_batch *ptr, uint64_t high) {
+  return (uint64_t)ptr | (high << TC_HIGH_SHIFT);
+}
+
+bool transfer_push(uint8_t sc_index, size_t size, void **objs,
+                   uint16_t count) {
+  transfer_batch *batch = objs[0], *top;
+  uint64_t old, depth;
+
+  io_msafe_assert(count > 0);
+  io_msafe_assert(((uintptr_t)batch & ~TC_PTR_MASK) == 0);
+  for (uint16_t i = 0; i < count - 1; i++) {
+    ((transfer_batch *)objs[i])->next_obj = objs[i + 1];
+  }
+  ((transfer_batch *)objs[count - 1])->next_obj = NULL;
+
+  do {
+    old = _mmf_transfer[sc_index];
+    top = tc_ptr(old);
+    /* top may be popped and reused under us: then the CAS fails */
+    depth = top ? tc_high(top->below) : 0;
+    if (depth > 0 && (depth + 1) * count * size > _MMF_TRANSFER_BYTES) {
+      return false;
+    }
+    batch->below = tc_pack(top, depth + 1);
+  } while (!_mmf_cas64(&_mmf_transfer[sc_index],
+                       tc_pack(batch, tc_high(old) + 1), old));
+  return true;
+}
+
+uint16_t transfer_pop(uint8_t sc_index, void **objs) {
+  transfer_batch *top, *obj;
+  uint64_t old;
+  uint16_t count = 0;
+
+  do {
+    old = _mmf_transfer[sc_index];
+    top = tc_ptr(old);
+    if (top == NULL) {
+      return 0;
+    }
+  } while (!_mmf_cas64(&_mmf_transfer[sc_index],
+                       tc_pack(tc_ptr(top->below), tc_high(old) + 1), old));
+
+  for (obj = top; obj; obj = obj->next_obj) {
+    objs[count++] = obj;
+  }
+  return count;
+}
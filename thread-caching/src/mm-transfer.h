@@ -0,0 +1,28 @@
+#ifndef _MM_TRANSFER_H
+#define _MM_TRANSFER_H
+
+/**
+ * @file mm-transfer.h
+ * @brief Central per-size-class cache of object batches, shared by all
+ * threads. A thread whose tcache bin overflows pushes a batch here; a
+ * thread whose bin runs dry pops one before touching its superblocks.
+*/
+
+#include "mm-comm.h"
+#include "mm-cache-defines.h"
+
+/**
+ * @brief Hand count objects of a size class to other threads.
+ * @return false if the class already holds _MMF_TRANSFER_BYTES, in
+ * which case the caller keeps the objects.
+*/
+bool transfer_push(uint8_t sc_index, size_t size, void **objs,
+                   uint16_t count);
+
+/**
+ * @brief Take the most recently pushed batch of a size class.
+ * @return the number of objects written to objs, 0 if there was none
+*/
+uint16_t transfer_pop(uint8_t sc_index, void **objs);
+
+#endif // _MM_TRANSFER_H